@@ -8,18 +8,145 @@
 #ifndef COMMON_COMMON_H_
 #define COMMON_COMMON_H_
 
+#include <cassert>
 #include <cmath>
+#include <cstring>
+
+#include <algorithm>
 #include <string>
 #include <vector>
 
+// A view of characters owned by someone else, such as a std::string or a
+// line buffer, which must outlive it. Copying it never copies the
+// characters.
+class StringPiece {
+ public:
+  static const size_t npos = static_cast<size_t>(-1);
+
+  StringPiece() : data_(NULL), size_(0) {}
+  StringPiece(const char* data, size_t size) : data_(data), size_(size) {}
+  StringPiece(const char* str) : data_(str), size_(strlen(str)) {}
+  StringPiece(const std::string& str) : data_(str.data()),
+      size_(str.size()) {}
+
+  const char* data() const {
+    return data_;
+  }
+  size_t size() const {
+    return size_;
+  }
+  bool empty() const {
+    return size_ == 0;
+  }
+  const char* begin() const {
+    return data_;
+  }
+  const char* end() const {
+    return data_ + size_;
+  }
+  char operator[](size_t i) const {
+    return data_[i];
+  }
+
+  // At most n characters from pos
+  StringPiece substr(size_t pos, size_t n = npos) const {
+    pos = std::min(pos, size_);
+    return StringPiece(data_ + pos, std::min(n, size_ - pos));
+  }
+
+  // Position of the first c or s at or after pos, npos if there is none.
+  // Characters are scanned by memchr, which is vectorized by the C library.
+  size_t find(char c, size_t pos = 0) const;
+  size_t find(StringPiece s, size_t pos = 0) const;
+
+  std::string ToString() const {
+    return std::string(data_, size_);
+  }
+
+  bool operator==(StringPiece other) const {
+    return size_ == other.size_ &&
+        (size_ == 0 || memcmp(data_, other.data_, size_) == 0);
+  }
+  bool operator!=(StringPiece other) const {
+    return !(*this == other);
+  }
+
+ private:
+  const char* data_;
+  size_t size_;
+};
+
+// Fields of a string separated by a delimiter of one or more characters,
+// returned one at a time as views of the string without any allocation.
+// Like CmnUtils::Split, adjacent delimiters give empty fields but the input
+// ending with a delimiter does not.
+//
+//   StringSplitter fields(line, ' ');
+//   for (StringPiece field; fields.Next(&field); ) {
+//     ...
+//   }
+class StringSplitter {
+ public:
+  StringSplitter(StringPiece input, char delim) : input_(input),
+      delim_(delim), delim_str_(&delim_, 1), pos_(0) {}
+  // @param delim not empty
+  StringSplitter(StringPiece input, StringPiece delim) : input_(input),
+      delim_(delim.empty() ? 0 : delim[0]), delim_str_(delim), pos_(0) {
+    assert(!delim.empty());
+  }
+
+  // @return false if there is no field left
+  bool Next(StringPiece* field) {
+    if (pos_ >= input_.size()) {
+      return false;
+    }
+
+    size_t end = (delim_str_.size() == 1) ? input_.find(delim_, pos_)
+        : input_.find(delim_str_, pos_);
+    if (end == StringPiece::npos) {
+      end = input_.size();
+    }
+    *field = StringPiece(input_.data() + pos_, end - pos_);
+    pos_ = end + delim_str_.size();
+    return true;
+  }
+
+ private:
+  StringPiece input_;
+  char delim_;
+  StringPiece delim_str_;
+  size_t pos_;
+
+  StringSplitter(const StringSplitter&);
+  void operator=(const StringSplitter&);
+};
+
 class CmnUtils {
  public:
   static std::string Trim(const std::string& input);
 
+  // Resolves literals and char pointers, which convert to both std::string
+  // and StringPiece, to the std::string result as before
+  static std::string Trim(const char* input) {
+    return Trim(StringPiece(input)).ToString();
+  }
+
+  // Strip blanks from both ends without copying
+  static StringPiece Trim(StringPiece input);
+
   static void Split(const std::string& input, char delim,
                     std::vector<std::string>* output);
 
-  // Retrieve all file names with a named suffix in the specified folder
+  // Split into views of input, see StringSplitter to avoid the vector
+  //
+  // @param output OUTPUT, the fields are appended
+  static void Split(StringPiece input, char delim,
+                    std::vector<StringPiece>* output);
+  static void Split(StringPiece input, StringPiece delim,
+                    std::vector<StringPiece>* output);
+
+  // Retrieve all file names with a named suffix in the specified folder. See
+  // DirWalker to walk subfolders or many files.
   static void RetrieveFilenames(const std::string& dir_name,
       const std::string& suffix, std::vector<std::string>* filename_list,
       bool ignore_case);
@@ -28,10 +155,23 @@ class CmnUtils {
   static void RetrieveDirNames(const std::string& dir_name,
       std::vector<std::string>* dir_name_list);
 
-#ifndef __MINGW32__
+  // Decode UTF-8 into UTF-32, or UTF-16 where wchar_t has 16 bits. Invalid
+  // input, such as overlong forms, surrogates and truncated sequences, is
+  // rejected. Runs of ASCII, 2-byte and 3-byte sequences are decoded 16, 8
+  // and 4 characters at a time with SIMD.
+  //
+  // @param wchar OUTPUT, wchar_len >= utf8_len always suffices
+  // @return the number of wchar_t written, 0 if utf8 is invalid or does not
+  //         fit into wchar
   static int Utf8ToWChar(const char *utf8, int utf8_len, wchar_t *wchar,
       int wchar_len);
-#endif
+
+  // Decode into a buffer which keeps its capacity, so decoding many strings
+  // does not allocate once it has grown
+  //
+  // @param wchar OUTPUT, empty if utf8 is invalid
+  // @return false if utf8 is invalid
+  static bool Utf8ToWChar(StringPiece utf8, std::wstring* wchar);
 
  private:
   static bool IsBlank(const char ch) {
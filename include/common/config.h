@@ -12,73 +12,168 @@
 #include <cassert>
 #include <string>
 #include <map>
+#include <vector>
+#include <utility>
+
+#include <atomic>
+#include <mutex>
 
 #include "header.h"
 
 // '#' is recognized as the head of a comment.
 // And config file only supports English by now
+//
+// Values are parsed into int, float and bool once when they are put. Every
+// update publishes a new immutable snapshot of all properties through an
+// atomic pointer, so reads never lock and are safe while another thread
+// updates. Updates are serialized and copy the snapshot. A replaced snapshot
+// is retired to a list owned by the Config and freed with it, since readers
+// may still hold references into it, so updates are meant to be rare
+// compared to reads.
 class Config {
  public:
-  Config() {
-    new (this)Config(".");
-  }
-  Config(const char* file_path) : file_path_(file_path) {}
-  ~Config() {}
+  // A key resolved once by Resolve, which makes repeated reads a pointer
+  // load and an array index instead of a map lookup
+  class Key {
+   public:
+    Key() : slot_(-1) {}
+
+   private:
+    friend class Config;
+
+    explicit Key(int slot) : slot_(slot) {}
+
+    int slot_;
+  };
+
+  Config();
+  Config(const char* file_path);
+  ~Config();
 
   void set_file_path(const std::string& file_path) {
     file_path_ = file_path;
   }
 
+  // Load the file and publish all of its properties at once
   bool Load();
 
-  bool Put(std::string key, std::string value);
+  bool Put(const std::string& key, const std::string& value);
+
+  void PutByForce(const std::string& key, const std::string& value);
+
+  bool Exist(const std::string& key) const;
+
+  bool Change(const std::string& key, const std::string& value);
 
-  void PutByForce(std::string key, std::string value) {
-    properties_[key] = value;
+  const std::string& Get(const std::string& key) const {
+    return Get(Find(key));
   }
 
-  bool Exist(std::string key) {
-    return Get(key).length() > 0;
+  bool GetBool(const std::string& key) const throw (std::string) {
+    return GetBool(Find(key));
   }
 
-  bool Change(std::string key, std::string value) {
-    if (!Exist(key)) {
-      return false;
-    }
+  int GetInt(const std::string& key) const {
+    return GetInt(Find(key));
+  }
 
-    PutByForce(key, value);
-    return true;
+  float GetFloat(const std::string& key) const {
+    return GetFloat(Find(key));
   }
 
-  std::string Get(std::string key) {
-    Properties::iterator itr = properties_.find(key);
+  // The handle stays valid for the lifetime of the Config, and reads see
+  // the key once it is put even if it was absent when resolved
+  Key Resolve(const std::string& key);
 
-    if (itr == properties_.end()) {
-      assert(false);
-    }
+  bool Exist(Key key) const {
+    const Value& value = Lookup(key);
+    return value.present && value.text.length() > 0;
+  }
 
-    return itr->second;
+  // The reference stays valid for the lifetime of the Config
+  const std::string& Get(Key key) const {
+    const Value& value = Lookup(key);
+    assert(value.present);
+    return value.text;
   }
 
-  bool GetBool(std::string key) throw (std::string);
+  bool GetBool(Key key) const throw (std::string);
 
-  int GetInt(std::string key) {
-    std::string value = Get(key);
-    return atoi(value.c_str());
+  int GetInt(Key key) const {
+    const Value& value = Lookup(key);
+    assert(value.present);
+    return value.int_value;
   }
 
-  float GetFloat(std::string key) {
-    std::string value = Get(key);
-    return atof(value.c_str());
+  float GetFloat(Key key) const {
+    const Value& value = Lookup(key);
+    assert(value.present);
+    return value.float_value;
   }
 
   void Store();
 
  private:
+  enum UpdateMode {
+    kInsert,
+    kAssign,
+    kChange
+  };
+
+  struct Value {
+    // An absent value of the key
+    explicit Value(const std::string& name) : name(name), present(false),
+        int_value(0), float_value(0), bool_value(-1) {}
+    Value(const std::string& name, const std::string& text);
+
+    std::string name;
+    std::string text;
+    bool present;
+    int int_value;
+    float float_value;
+    // 1 for "true", 0 for "false", -1 otherwise
+    int bool_value;
+  };
+
+  // An immutable version of the properties. slots maps every key put or
+  // resolved so far to its index in values, and only grows.
+  struct Snapshot {
+    std::map<std::string, int> slots;
+    std::vector<Value> values;
+  };
+
+  typedef std::vector<std::pair<std::string, std::string> > Properties;
+
   std::string file_path_;
+  std::atomic<const Snapshot*> snapshot_;
+  // Serializes the updates and guards retired_
+  std::mutex update_lock_;
+  // Replaced snapshots, freed with the Config
+  std::vector<const Snapshot*> retired_;
+
+  // Key of an existing property, asserts otherwise
+  Key Find(const std::string& key) const;
+
+  const Snapshot* Current() const {
+    return snapshot_.load(std::memory_order_acquire);
+  }
+
+  const Value& Lookup(Key key) const {
+    const Snapshot* snapshot = Current();
+    assert(key.slot_ >= 0 &&
+        key.slot_ < static_cast<int>(snapshot->values.size()));
+    return snapshot->values[key.slot_];
+  }
+
+  // Retire the current snapshot and publish next. The caller holds
+  // update_lock_.
+  void Publish(const Snapshot* next);
 
-  typedef std::map<std::string, std::string> Properties;
-  Properties properties_;
+  // Apply the properties allowed by mode to a copy of the current snapshot
+  // and publish it if anything changed
+  //
+  // @return the number of properties applied
+  int Update(const Properties& properties, UpdateMode mode);
 
   DISALLOW_COPY_AND_ASSIGN(Config);
 };
@@ -0,0 +1,104 @@
+// Copyright (c) 2010-2011, Tuji
+// All rights reserved.
+//
+// ${license}
+//
+// Author: LIU Yi
+
+#ifndef COMMON_DIR_WALKER_H_
+#define COMMON_DIR_WALKER_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Receives the entries found by DirWalker::Walk. Visit is called concurrently
+// from the walking threads unless there is only one.
+class DirVisitor {
+ public:
+  virtual ~DirVisitor() {}
+
+  // @param path relative to the root, with '/' separators
+  // @param is_dir true for a directory, false for a regular file
+  virtual void Visit(const std::string& path, bool is_dir) = 0;
+};
+
+// Recursive listing of a directory tree. Entries are classified by the type
+// returned with them by the file system, and stat is only called when it is
+// unknown or for symbolic links. Directories are opened relative to the root
+// and read in large batches by getdents64 on Linux. Subdirectories are
+// queued per thread, and idle threads steal from the queues of others, so
+// wide and deep trees are both spread across threads.
+//
+// Symbolic links to files are reported as files, and those to directories are
+// reported but not descended into, so there can be no cycle.
+class DirWalker {
+ public:
+  DirWalker();
+
+  // Only report the regular files whose name matches any of the patterns,
+  // or all of them if no pattern is added. '*' matches any characters and
+  // '?' one character. Patterns are compiled once, and those like "*.jpg" or
+  // "img_*" into a single comparison of the suffix or prefix.
+  void AddPattern(const std::string& pattern, bool ignore_case = false);
+
+  // Same as a pattern of '*' and suffix, except that '*' and '?' in suffix
+  // match themselves
+  void AddSuffix(const std::string& suffix, bool ignore_case = false);
+
+  int num_threads() const {
+    return num_threads_;
+  }
+  void set_num_threads(int num_threads) {
+    num_threads_ = (num_threads > 0) ? num_threads : 1;
+  }
+
+  // Levels of subdirectories descended into, 0 for the entries of the root
+  // only, negative for no limit
+  int max_depth() const {
+    return max_depth_;
+  }
+  void set_max_depth(int max_depth) {
+    max_depth_ = max_depth;
+  }
+
+  // Also report the directories, which are never filtered by the patterns
+  bool report_dirs() const {
+    return report_dirs_;
+  }
+  void set_report_dirs(bool report_dirs) {
+    report_dirs_ = report_dirs;
+  }
+
+  // Report the entries under root in no particular order. Subdirectories
+  // which can not be opened are skipped.
+  //
+  // @return false if root can not be opened
+  bool Walk(const std::string& root, DirVisitor* visitor) const;
+
+  // Whether a file name passes the patterns
+  bool Matches(const char* name, size_t length) const;
+
+ private:
+  struct Pattern {
+    enum Kind {
+      kExact,
+      kPrefix,
+      kSuffix,
+      kGlob
+    };
+
+    Kind kind;
+    // Lower case if ignore_case, without the '*' of a prefix or suffix
+    std::string text;
+    bool ignore_case;
+  };
+
+  std::vector<Pattern> patterns_;
+  bool any_ignore_case_;
+  int num_threads_;
+  int max_depth_;
+  bool report_dirs_;
+};
+
+#endif
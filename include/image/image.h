@@ -61,6 +61,22 @@ class ImgUtils {
   // 冯星奎, 李林艳, 等. 一种新的指纹图象细化算法. 中国图像图形学报. 1999年10月
   static void Thin(const cv::Mat& binary, cv::Mat* dst);
 
+  // Exact Euclidean distance transform in two separable passes, columns then
+  // rows, each processed in parallel. The cost does not depend on the stroke
+  // width, unlike repeated erosions with SimpleMorph.
+  //
+  // P. F. Felzenszwalb and D. P. Huttenlocher,
+  // "Distance transforms of sampled functions,"
+  // Theory of Computing, vol. 8, 2012, pp. 415-428.
+  //
+  // @param binary the input matrix with type CV_8UC1, the distance is measured
+  //        from every pixel to the nearest zero pixel
+  // @param dist OUTPUT, CV_32FC1 distance, FLT_MAX if there is no zero pixel
+  // @param nearest OUTPUT, CV_32SC1 index (y * cols + x) of the nearest zero
+  //        pixel, -1 if there is no zero pixel, ignored if NULL
+  static void DistanceTransform(const cv::Mat& binary, cv::Mat* dist,
+      cv::Mat* nearest = NULL);
+
   // Stretch the histogram to bright image
   static void StretchHistogram(const cv::Mat& gray, cv::Mat* dst);
 
@@ -77,6 +93,38 @@ class ImgUtils {
   static int FloodFill(cv::Mat* img, cv::Point seed, int new_value,
       cv::Rect* rect = NULL, int lo_diff = 0, int up_diff = 0);
 
+  // Calculate the integral image and optionally the squared integral image.
+  // Both outputs have size (rows + 1) x (cols + 1) with a zero first row and
+  // column. The accumulator is CV_32SC1 when the total of an CV_8UC1 input
+  // can not overflow 32 bits, and CV_64FC1 otherwise.
+  //
+  // @param gray the input matrix with type CV_8UC1 or CV_32FC1
+  // @param sum OUTPUT, the integral image
+  // @param sqsum OUTPUT, the squared integral image, ignored if NULL
+  static void Integral(const cv::Mat& gray, cv::Mat* sum,
+      cv::Mat* sqsum = NULL);
+
+  // Sum of the pixels inside rect in O(1), rect must lie inside the image
+  // the integral image sum was built from
+  static double RectSum(const cv::Mat& sum, const cv::Rect& rect);
+
+  static double RectMean(const cv::Mat& sum, const cv::Rect& rect) {
+    return rect.area() > 0 ? RectSum(sum, rect) / rect.area() : 0;
+  }
+
+  static double RectVariance(const cv::Mat& sum, const cv::Mat& sqsum,
+      const cv::Rect& rect);
+
+  // Query the mean and variance of every rectangle in O(1) each
+  //
+  // @param sum the integral image built by Integral
+  // @param sqsum the squared integral image, may be empty if variance is NULL
+  // @param mean OUTPUT, mean of each rect, ignored if NULL
+  // @param variance OUTPUT, variance of each rect, ignored if NULL
+  static void RectStats(const cv::Mat& sum, const cv::Mat& sqsum,
+      const std::vector<cv::Rect>& rects, std::vector<double>* mean,
+      std::vector<double>* variance);
+
  private:
   static cv::Mat sobel_filter_x_;
   static cv::Mat sobel_filter_y_;
@@ -9,73 +9,584 @@
 #define MATH_MATH_H_
 
 #include <cmath>
+#include <cstring>
 #include <ctime>
+#include <stdint.h>
 
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <utility>
 #include <vector>
 #include <random>
 
 #include <opencv2/core/core.hpp>
 
+// Engines of Random. kMt19937 reproduces the sequences of std::mt19937 for
+// the same seed but carries a 5 KB state, the others keep 32 bytes. RandomInt
+// and RandomReal map kMt19937 through the std distributions, so seeded
+// sequences stay those of earlier versions, and the faster engines through
+// multiplication and mantissa bits.
+//
+// kXoshiro256: D. Blackman and S. Vigna, "Scrambled linear pseudorandom
+// number generators," ACM Transactions on Mathematical Software, vol. 47,
+// 2021.
+// kPcg64: M. E. O'Neill, "PCG: A family of simple fast space-efficient
+// statistically good algorithms for random number generation," Harvey Mudd
+// College, HMC-CS-2014-0905, 2014.
+// kPhilox: J. K. Salmon, M. A. Moraes, R. O. Dror, and D. E. Shaw,
+// "Parallel random numbers: as easy as 1, 2, 3," SC '11, 2011.
+enum RandomEngine {
+  kMt19937,
+  kXoshiro256,
+  kPcg64,
+  kPhilox
+};
+
 class Random {
  public:
-  Random() {
-    rng_.seed(static_cast<unsigned int>(time(NULL)));
+  // Seeded differently on every construction, even within the same second
+  explicit Random(RandomEngine engine = kMt19937) : engine_(engine) {
+    Seed(UniqueSeed(), 0);
   }
-  Random(unsigned int seed) {
-    rng_.seed(seed);
+  Random(unsigned int seed, RandomEngine engine = kMt19937) : engine_(engine) {
+    Seed(seed, 0);
   }
+  // The stream-th of the streams derived from a master seed, so that every
+  // thread of a parallel computation gets its own reproducible sequence.
+  // Streams of kXoshiro256 are 2^128 values apart, those of kPcg64 and
+  // kPhilox are different sequences by construction, and those of kMt19937
+  // are seeded through std::seed_seq.
+  Random(uint64_t seed, int stream, RandomEngine engine) : engine_(engine) {
+    Seed(seed, stream);
+  }
+  Random(const Random& other);
+  Random& operator=(const Random& other);
   virtual ~Random() {}
 
+  RandomEngine engine() const {
+    return engine_;
+  }
+
+  // 64 uniformly distributed bits
+  uint64_t NextBits() {
+    switch (engine_) {
+      case kXoshiro256:
+        return NextXoshiro(state_);
+      case kPcg64:
+        return NextPcg(state_);
+      case kPhilox:
+        return NextPhilox();
+      default: {
+        uint64_t high = (*mt_)();
+        return (high << 32) | (*mt_)();
+      }
+    }
+  }
+
+  // Same as n calls to NextBits, with the engine chosen once
+  void FillBits(uint64_t* out, size_t n);
+
  protected:
-  std::mt19937 rng_;
+  // Values generated per chunk of Fill
+  static const size_t kFillChunk = 256;
+
+  // Uniform value in [0, 1) from the top bits of a word
+  template <typename T>
+  static T Unit(uint64_t bits);
+
+  // The engine of kMt19937, NULL for the others
+  std::mt19937* mt() {
+    return mt_.get();
+  }
+
+  // min + Unit(bits[i]) * range for each word
+  static void UniformReal(const uint64_t* bits, size_t n, double min,
+      double range, double* out);
+  static void UniformReal(const uint64_t* bits, size_t n, float min,
+      float range, float* out);
+  template <typename T>
+  static void UniformReal(const uint64_t* bits, size_t n, T min, T range,
+      T* out) {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = min + Unit<T>(bits[i]) * range;
+    }
+  }
 
   // OPTIMIZE
   virtual void abstract() = 0;
 
+ private:
+  RandomEngine engine_;
+  // Only allocated for kMt19937
+  std::unique_ptr<std::mt19937> mt_;
+  // kXoshiro256: s0..s3
+  // kPcg64: low and high words of the state, then of the increment
+  // kPhilox: low and high words of the counter, then the key
+  uint64_t state_[4];
+  // Unused words of the last Philox block
+  uint64_t buffer_[2];
+  int buffered_;
+
+  static uint64_t UniqueSeed();
+
+  void Seed(uint64_t seed, int stream);
+
+  // Advance kXoshiro256 by 2^128 values
+  void JumpXoshiro();
+
+  // The engines take the state by pointer so that FillBits can run them on a
+  // local copy held in registers
+  static uint64_t NextXoshiro(uint64_t* s) {
+    uint64_t result = Rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = Rotl(s[3], 45);
+    return result;
+  }
+
+  // 128-bit LCG step followed by the XSL RR output function
+  static uint64_t NextPcg(uint64_t* s) {
+    const uint64_t kMulLow = 0x4385DF649FCCF645ULL;
+    const uint64_t kMulHigh = 0x2360ED051FC65DA4ULL;
+    uint64_t low = s[0] * kMulLow;
+    uint64_t high = MulHigh(s[0], kMulLow) + s[0] * kMulHigh + s[1] * kMulLow;
+    s[0] = low + s[2];
+    s[1] = high + s[3] + (s[0] < low);
+    return Rotr(s[1] ^ s[0], static_cast<int>(s[1] >> 58));
+  }
+
+  uint64_t NextPhilox() {
+    if (buffered_ == 0) {
+      PhiloxBlock(state_, buffer_);
+      ++state_[0];
+      buffered_ = 2;
+    }
+    return buffer_[2 - buffered_--];
+  }
+
+  // Philox4x32-10 of the counter state[0..1] with the key state[2]
+  static void PhiloxBlock(const uint64_t* state, uint64_t* out);
+
+  static uint64_t Rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+  }
+
+  static uint64_t Rotr(uint64_t x, int k) {
+    return (x >> k) | (x << ((64 - k) & 63));
+  }
+
+  static uint64_t MulHigh(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    return static_cast<uint64_t>((static_cast<unsigned __int128>(a) * b) >> 64);
+#else
+    uint64_t a0 = a & 0xFFFFFFFF, a1 = a >> 32;
+    uint64_t b0 = b & 0xFFFFFFFF, b1 = b >> 32;
+    uint64_t mid = (a0 * b0 >> 32) + (a1 * b0 & 0xFFFFFFFF) + a0 * b1;
+    return a1 * b1 + (a1 * b0 >> 32) + (mid >> 32);
+#endif
+  }
 };
 
 class RandomInt : public Random {
  public:
-  RandomInt() {}
-  RandomInt(unsigned int seed) : Random(seed) {}
-  RandomInt(int min, int max_inclusive) : distribution_(min, max_inclusive) {}
-  RandomInt(unsigned int seed, int min, int max_inclusive) : Random(seed),
-      distribution_(min, max_inclusive) {}
+  explicit RandomInt(RandomEngine engine = kMt19937) : Random(engine) {
+    SetRange(0, std::numeric_limits<int>::max());
+  }
+  RandomInt(unsigned int seed, RandomEngine engine = kMt19937)
+      : Random(seed, engine) {
+    SetRange(0, std::numeric_limits<int>::max());
+  }
+  RandomInt(int min, int max_inclusive) {
+    SetRange(min, max_inclusive);
+  }
+  RandomInt(unsigned int seed, int min, int max_inclusive,
+      RandomEngine engine = kMt19937) : Random(seed, engine) {
+    SetRange(min, max_inclusive);
+  }
+  RandomInt(uint64_t seed, int stream, RandomEngine engine, int min,
+      int max_inclusive) : Random(seed, stream, engine) {
+    SetRange(min, max_inclusive);
+  }
   virtual ~RandomInt() {}
 
   int Next() {
-    return distribution_(rng_);
+    if (engine() == kMt19937) {
+      return distribution_(*mt());
+    }
+    return static_cast<int>(min_ + static_cast<int64_t>(Bounded(NextBits())));
   }
 
+  // Same distribution as n calls to Next. The values are equal as well
+  // unless one is rejected to keep the distribution exact, which happens with
+  // probability below (max - min + 1) / 2^32 per value, and always for
+  // kMt19937.
+  void Fill(int* out, size_t n);
+
  private:
+  // Only used for kMt19937
   std::uniform_int_distribution<int> distribution_;
+  int min_;
+  // Number of values, up to 2^32
+  uint64_t range_;
+  // Low 32 bits of a product below it are rejected
+  uint64_t threshold_;
+
+  void SetRange(int min, int max_inclusive) {
+    CV_Assert(min <= max_inclusive);
+    distribution_.param(
+        std::uniform_int_distribution<int>::param_type(min, max_inclusive));
+    min_ = min;
+    range_ = static_cast<uint64_t>(static_cast<int64_t>(max_inclusive) - min +
+        1);
+    threshold_ = ((1ULL << 32) - range_) % range_;
+  }
+
+  // Uniform in [0, range_) from the top 32 bits, by multiplication and
+  // rejection.
+  //
+  // D. Lemire, "Fast random integer generation in an interval," ACM
+  // Transactions on Modeling and Computer Simulation, vol. 29, 2019.
+  uint64_t Bounded(uint64_t bits) {
+    uint64_t product = (bits >> 32) * range_;
+    while ((product & 0xFFFFFFFF) < threshold_) {
+      product = (NextBits() >> 32) * range_;
+    }
+    return product >> 32;
+  }
 
   void abstract() {}
 
 };
 
+// Uniform values in [min, max_inclusive). kMt19937 goes through
+// std::uniform_real_distribution, and the other engines take 52 random bits
+// for double and 23 for float from the top of one NextBits word per value.
 template <typename ResultType>
 class RandomReal : public Random {
  public:
-  RandomReal() {}
-  RandomReal(unsigned int seed) : Random(seed) {}
-  RandomReal(ResultType min, ResultType max_inclusive) : distribution_(min, max_inclusive) {}
-  RandomReal(unsigned int seed, ResultType min, ResultType max_inclusive) : Random(seed),
-      distribution_(min, max_inclusive) {}
+  explicit RandomReal(RandomEngine engine = kMt19937) : Random(engine),
+      min_(0), range_(1) {}
+  RandomReal(unsigned int seed, RandomEngine engine = kMt19937)
+      : Random(seed, engine), min_(0), range_(1) {}
+  RandomReal(ResultType min, ResultType max_inclusive)
+      : distribution_(min, max_inclusive), min_(min),
+      range_(max_inclusive - min) {}
+  RandomReal(unsigned int seed, ResultType min, ResultType max_inclusive,
+      RandomEngine engine = kMt19937) : Random(seed, engine),
+      distribution_(min, max_inclusive), min_(min),
+      range_(max_inclusive - min) {}
+  RandomReal(uint64_t seed, int stream, RandomEngine engine, ResultType min,
+      ResultType max_inclusive) : Random(seed, stream, engine),
+      distribution_(min, max_inclusive), min_(min),
+      range_(max_inclusive - min) {}
   virtual ~RandomReal() {}
 
   ResultType Next() {
-    return distribution_(rng_);
+    if (engine() == kMt19937) {
+      return distribution_(*mt());
+    }
+    return min_ + Unit<ResultType>(NextBits()) * range_;
+  }
+
+  // Same values as n calls to Next, converted with SIMD except for kMt19937
+  void Fill(ResultType* out, size_t n) {
+    if (engine() == kMt19937) {
+      for (size_t i = 0; i < n; ++i) {
+        out[i] = distribution_(*mt());
+      }
+      return;
+    }
+
+    uint64_t bits[kFillChunk];
+    for (size_t i = 0; i < n; i += kFillChunk) {
+      size_t m = std::min(kFillChunk, n - i);
+      FillBits(bits, m);
+      UniformReal(bits, m, min_, range_, out + i);
+    }
   }
 
  private:
+  // Only used for kMt19937
   std::uniform_real_distribution<ResultType> distribution_;
+  ResultType min_;
+  ResultType range_;
 
   void abstract() {}
 };
 
+template <typename T>
+T Random::Unit(uint64_t bits) {
+  return static_cast<T>(Unit<double>(bits));
+}
+
+// The top 52 bits become the mantissa of a double in [1, 2)
+template <>
+inline double Random::Unit<double>(uint64_t bits) {
+  uint64_t u = 0x3FF0000000000000ULL | (bits >> 12);
+  double value;
+  memcpy(&value, &u, sizeof(value));
+  return value - 1.0;
+}
+
+template <>
+inline float Random::Unit<float>(uint64_t bits) {
+  uint32_t u = 0x3F800000 | static_cast<uint32_t>(bits >> 41);
+  float value;
+  memcpy(&value, &u, sizeof(value));
+  return value - 1.0f;
+}
+
+// Numerically stable count, mean and variance of a stream of values. Values
+// are added one at a time by Welford's update or as arrays in blocks, and
+// partial results, e.g. of threads reducing parts of the data, are merged.
+//
+// T. F. Chan, G. H. Golub, and R. J. LeVeque,
+// "Algorithms for computing the sample variance: analysis and
+// recommendations," The American Statistician, vol. 37, 1983, pp. 242-247.
+class RunningStats {
+ public:
+  RunningStats() : n_(0), mean_(0), m2_(0) {}
+  // From the moments of a partial result
+  //
+  // @param m2 the sum of squared deviations from mean
+  RunningStats(size_t n, double mean, double m2) : n_(n), mean_(mean),
+      m2_(m2) {}
+
+  void Push(double x) {
+    ++n_;
+    double delta = x - mean_;
+    mean_ += delta / n_;
+    m2_ += delta * (x - mean_);
+  }
+
+  // Add n values, such as a row of a cv::Mat. Arrays of float, double and
+  // int are reduced in blocks with SIMD, each by two passes while it is in
+  // cache, and the blocks are merged.
+  void Push(const float* data, size_t n);
+  void Push(const double* data, size_t n);
+  void Push(const int* data, size_t n);
+  template <typename T>
+  void Push(const T* data, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      Push(static_cast<double>(data[i]));
+    }
+  }
+
+  void Merge(const RunningStats& other) {
+    if (other.n_ == 0) {
+      return;
+    }
+    if (n_ == 0) {
+      *this = other;
+      return;
+    }
+
+    size_t n = n_ + other.n_;
+    double delta = other.mean_ - mean_;
+    mean_ += delta * other.n_ / n;
+    m2_ += other.m2_ + delta * delta * (static_cast<double>(n_) * other.n_ / n);
+    n_ = n;
+  }
+
+  size_t count() const {
+    return n_;
+  }
+  // 0 if there is no value
+  double mean() const {
+    return mean_;
+  }
+  // Population variance, 0 if there is no value
+  double variance() const {
+    return (n_ > 0) ? m2_ / n_ : 0;
+  }
+  double std_dev() const {
+    return sqrt(variance());
+  }
+
+ private:
+  size_t n_;
+  double mean_;
+  // Sum of squared deviations from mean_
+  double m2_;
+};
+
+// Counts of a stream of values in equal bins over [lower, upper), plus the
+// values below and above. Histograms with the same bins, e.g. filled by
+// different threads from parts of the data, are merged by adding counts.
+// Quantiles are interpolated within a bin, so their error is at most one
+// bin width.
+class Histogram {
+ public:
+  Histogram(double lower, double upper, int bins) : lower_(lower),
+      upper_(upper), scale_(bins / (upper - lower)), bins_(bins), n_(0),
+      counts_(bins + 2, 0) {
+    CV_Assert(upper > lower && bins > 0);
+  }
+
+  // NaN is counted below lower
+  void Push(double x) {
+    ++counts_[Bin(x)];
+    ++n_;
+  }
+
+  // Add n values, such as a row of a cv::Mat. The bins of arrays of float,
+  // double and int are found 4 values at a time with SIMD.
+  void Push(const float* data, size_t n);
+  void Push(const double* data, size_t n);
+  void Push(const int* data, size_t n);
+  template <typename T>
+  void Push(const T* data, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      Push(static_cast<double>(data[i]));
+    }
+  }
+
+  // other must have the same bounds and bins
+  void Merge(const Histogram& other);
+
+  // Value of rank q * count(), interpolated linearly within its bin. Ranks
+  // below or above the range give lower or upper.
+  //
+  // @param q in [0, 1], e.g. 0.5 for the median
+  // @return 0 if there is no value
+  double Quantile(double q) const;
+
+  // Number of values, including those out of range
+  uint64_t count() const {
+    return n_;
+  }
+  uint64_t bin_count(int bin) const {
+    return counts_[bin + 1];
+  }
+  uint64_t below() const {
+    return counts_[0];
+  }
+  uint64_t above() const {
+    return counts_[bins_ + 1];
+  }
+  int bins() const {
+    return bins_;
+  }
+  double lower() const {
+    return lower_;
+  }
+  double upper() const {
+    return upper_;
+  }
+
+ private:
+  double lower_;
+  double upper_;
+  // Bins per unit of value
+  double scale_;
+  int bins_;
+  uint64_t n_;
+  // Values below, then each bin, then values above
+  std::vector<uint64_t> counts_;
+
+  // Index into counts_. The bulk Push computes the same with SIMD.
+  int Bin(double x) const {
+    double t = (x - lower_) * scale_;
+    t = (t >= -1) ? std::min(t, static_cast<double>(bins_)) : -1;
+    return static_cast<int>(t + 1);
+  }
+};
+
+// Approximate quantiles of a stream of values in bounded memory by a merging
+// t-digest. Values are buffered and periodically merged into at most about
+// compression clusters, which are smaller near the tails, so extreme
+// quantiles stay accurate. Sketches, e.g. of threads summarizing parts of
+// the data, are merged without loss beyond that of a single sketch.
+//
+// T. Dunning and O. Ertl, "Computing extremely accurate quantiles using
+// t-digests," arXiv:1902.04023, 2019.
+class QuantileSketch {
+ public:
+  // @param compression larger values keep more clusters and give smaller
+  //        errors, about q * (1 - q) / compression in rank
+  explicit QuantileSketch(double compression = 100);
+
+  void Push(double x) {
+    buffer_.push_back(x);
+    ++n_;
+    min_ = std::min(min_, x);
+    max_ = std::max(max_, x);
+    if (buffer_.size() >= capacity_) {
+      Compress();
+    }
+  }
+
+  template <typename T>
+  void Push(const T* data, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      Push(static_cast<double>(data[i]));
+    }
+  }
+
+  void Merge(const QuantileSketch& other);
+
+  // Merge the buffered values into the clusters. Quantile does this on a
+  // copy while values are buffered, so call it before many queries.
+  void Compress();
+
+  // @param q in [0, 1], e.g. 0.5 for the median
+  // @return the value of rank about q * count(), exactly min() for 0 and
+  //         max() for 1, 0 if there is no value
+  double Quantile(double q) const;
+
+  uint64_t count() const {
+    return n_;
+  }
+  // Infinity if there is no value
+  double min() const {
+    return min_;
+  }
+  // -Infinity if there is no value
+  double max() const {
+    return max_;
+  }
+
+ private:
+  struct Centroid {
+    Centroid(double mean, double weight) : mean(mean), weight(weight) {}
+
+    bool operator<(const Centroid& other) const {
+      return mean < other.mean;
+    }
+
+    double mean;
+    double weight;
+  };
+
+  double compression_;
+  size_t capacity_;
+  uint64_t n_;
+  double min_;
+  double max_;
+  // Clusters sorted by mean
+  std::vector<Centroid> centroids_;
+  // Values not yet merged into the clusters
+  std::vector<double> buffer_;
+
+  // Merge sorted clusters with centroids_ and recluster
+  void Absorb(const std::vector<Centroid>& incoming);
+};
+
 class MathUtils {
 public:
+  // Score decay of SoftNonMaxSuppression for an overlap of IoU with a kept box
+  enum SoftNmsDecay {
+    // score *= 1 - IoU if IoU is above the threshold param
+    kLinearDecay,
+    // score *= exp(-IoU^2 / param)
+    kGaussianDecay
+  };
+
   static const double kPI;
 
   static bool IsFloat0(float f) {
@@ -111,10 +622,16 @@ public:
     virtual T operator() (T in) = 0;
   };
 
+  // Calculate the mean and population standard deviation in a single pass
+  // with RunningStats, both are 0 for no data
   template <typename T>
   static void MeanAndStdDev(const std::vector<T>& data_list, double* mean,
       double* std_dev);
 
+  template <typename T>
+  static void MeanAndStdDev(const T* data, size_t n, double* mean,
+      double* std_dev);
+
   // Calculate the Hessian matrix of a given position of a matrix
   //
   // @param mat the input matrix with type CV_32FC1
@@ -122,6 +639,43 @@ public:
   // @param hessian OUTPUT, the Hessian matrix
   static void CalcHessian(const cv::Mat& mat, cv::Point pos, cv::Mat* hessian);
 
+  // Calculate the Hessian of a given position like above without
+  // constructing any Mat, for evaluating many sparse points
+  //
+  // @param mat the input matrix with type CV_32FC1, at least 3x3
+  // @param pos the position to be calculated
+  // @param dxx OUTPUT
+  // @param dyy OUTPUT
+  // @param dxy OUTPUT
+  static void CalcHessian(const cv::Mat& mat, cv::Point pos, float* dxx,
+      float* dyy, float* dxy) {
+    // Shift the point to the inner neighbor if the point is located on the
+    // border
+    int x = std::min(std::max(pos.x, 1), mat.cols - 2);
+    int y = std::min(std::max(pos.y, 1), mat.rows - 2);
+    const float* up = mat.ptr<float>(y - 1) + x;
+    const float* cur = mat.ptr<float>(y) + x;
+    const float* down = mat.ptr<float>(y + 1) + x;
+
+    *dxx = (cur[-1] - (cur[0] + cur[0])) + cur[1];
+    *dyy = (up[0] - (cur[0] + cur[0])) + down[0];
+    *dxy = (((up[-1] - up[1]) - down[-1]) + down[1]) * 0.25f;
+  }
+
+  // Calculate the Hessian of every position of a matrix in one pass, with the
+  // stencils and border handling of CalcHessian. Rows are processed in
+  // parallel.
+  //
+  // @param mat the input matrix with type CV_32FC1, at least 3x3
+  // @param dxx OUTPUT, CV_32FC1
+  // @param dyy OUTPUT, CV_32FC1
+  // @param dxy OUTPUT, CV_32FC1
+  // @param edge OUTPUT, CV_32FC1 tr^2 / det of the Hessian, FLT_MAX where
+  //        det <= 0. Edges are rejected when it is not below (r + 1)^2 / r
+  //        for the ratio r of the principal curvatures. Ignored if NULL.
+  static void CalcHessianMaps(const cv::Mat& mat, cv::Mat* dxx, cv::Mat* dyy,
+      cv::Mat* dxy, cv::Mat* edge = NULL);
+
   // Check whether the input two erect rectangles is intersected, and if true,
   // assign the parameter "intersect" with intersected rectangle
   static bool IsRectIntersected(cv::Rect a, cv::Rect b,
@@ -137,30 +691,140 @@ public:
         );
   }
 
+  // Find all pairs of rectangles sharing a positive area, by sweeping along x
+  // while the rectangles crossing the sweep line are kept in an interval tree
+  // over y, in O(N log N + K) for K pairs instead of testing all pairs
+  //
+  // @param rects
+  // @param min_iou pairs whose intersection over union is below min_iou are
+  //        left out, 0 keeps every intersecting pair
+  // @param pairs OUTPUT, (i, j) with i < j, sorted
+  static void IntersectingRects(const std::vector<cv::Rect>& rects,
+      double min_iou, std::vector<std::pair<int, int> >* pairs);
+
+  // Group the rectangles linked by the pairs of IntersectingRects with
+  // union-find, without storing the pairs
+  //
+  // @param rects
+  // @param min_iou as in IntersectingRects
+  // @param boxes OUTPUT, the minimum bounding box of each cluster
+  // @param labels OUTPUT, the cluster of each rectangle, numbered in the order
+  //        of their first rectangle, ignored if NULL
+  // @return the number of clusters
+  static int ClusterRects(const std::vector<cv::Rect>& rects, double min_iou,
+      std::vector<cv::Rect>* boxes, std::vector<int>* labels = NULL);
+
+  // Greedy non-maximum suppression: visit the rectangles by decreasing score
+  // and keep each one whose IoU with every kept rectangle is at most
+  // iou_threshold. The kept rectangles are bucketed in a grid, so each one
+  // is only compared with the kept ones nearby, 4 at a time.
+  //
+  // @param rects
+  // @param scores the score of each rectangle
+  // @param iou_threshold
+  // @param keep OUTPUT, indices of the kept rectangles by decreasing score
+  static void NonMaxSuppression(const std::vector<cv::Rect>& rects,
+      const std::vector<float>& scores, double iou_threshold,
+      std::vector<int>* keep);
+
+  // Soft non-maximum suppression: repeatedly keep the rectangle with the
+  // highest score and decay the scores of those overlapping it, instead of
+  // removing them.
+  //
+  // N. Bodla, B. Singh, R. Chellappa, and L. S. Davis, "Soft-NMS - improving
+  // object detection with one line of code," ICCV 2017, pp. 5562-5570.
+  //
+  // @param rects
+  // @param scores the score of each rectangle
+  // @param decay
+  // @param param the IoU threshold of kLinearDecay or the sigma of
+  //        kGaussianDecay
+  // @param min_score rectangles whose score falls below it are dropped
+  // @param keep OUTPUT, indices of the kept rectangles in the order kept
+  // @param kept_scores OUTPUT, their decayed scores, ignored if NULL
+  static void SoftNonMaxSuppression(const std::vector<cv::Rect>& rects,
+      const std::vector<float>& scores, SoftNmsDecay decay, double param,
+      float min_score, std::vector<int>* keep,
+      std::vector<float>* kept_scores = NULL);
+
   static double Point2LineDist(cv::Point p, cv::Vec3f line) {
     return abs(p.x*line[0] + p.y*line[1] + line[2]) / sqrt(line[0]*line[0] + line[1]*line[1]);
   }
 
+  // Distances of many points to the same line, which is normalized once, 4
+  // points at a time
+  //
+  // @param dists OUTPUT, the distance of each point
+  static void Point2LineDist(const std::vector<cv::Point>& points,
+      cv::Vec3f line, std::vector<float>* dists);
+
+  // Convex hull by the monotone chain algorithm in O(N log N). Sets with
+  // many points per row, such as the pixels of a region, are first reduced to
+  // the leftmost and rightmost point of each row in O(N).
+  //
+  // A. M. Andrew, "Another efficient algorithm for convex hulls in two
+  // dimensions," Information Processing Letters, vol. 9, 1979, pp. 216-219.
+  //
+  // @param hull OUTPUT, the vertices without collinear ones, starting from
+  //        the leftmost of the topmost points and going clockwise as
+  //        displayed, with the y axis pointing down
+  static void ConvexHull(const std::vector<cv::Point>& points,
+      std::vector<cv::Point>* hull);
+
+  // The rectangle of minimum area enclosing the points, by rotating calipers
+  // around the convex hull in O(N log N)
+  //
+  // G. T. Toussaint, "Solving geometric problems with the rotating
+  // calipers," IEEE MELECON 1983.
+  //
+  // @return the rectangle whose width runs along angle, in degrees
+  static cv::RotatedRect MinAreaRect(const std::vector<cv::Point>& points);
+
+  // Centroid and major axis of the points from their second moments, which
+  // is also the total least squares line through them. The moments are
+  // summed exactly in integers around the first point.
+  //
+  // @param center OUTPUT
+  // @param angle OUTPUT, the direction of the major axis in radians, in
+  //        [-pi/2, pi/2]
+  // @param variances OUTPUT, the variances along the major and the minor
+  //        axis, ignored if NULL
+  static void PrincipalAxis(const std::vector<cv::Point>& points,
+      cv::Point2f* center, double* angle, cv::Vec2d* variances = NULL);
+
+  // Estimate the skew of text lines from the projection profile of points
+  // such as the pixels or the bottom centers of characters. The skew is the
+  // angle at which the profile across the lines, in bins of 1 pixel, has the
+  // largest sum of squared differences between adjacent bins. It is searched
+  // in steps of about 1 pixel at the far end of the points, then refined by
+  // halving the step.
+  //
+  // W. Postl, "Detection of linear oblique structures and skew scan in
+  // digitized documents," ICPR 1986, pp. 687-689.
+  //
+  // @param max_angle the angles searched are within [-max_angle, max_angle]
+  // @param precision the final step
+  // @return the direction of the lines in radians, positive if they go down
+  //         to the right as displayed, 0 for less than 2 points
+  static double EstimateSkew(const std::vector<cv::Point>& points,
+      double max_angle, double precision);
+
 };
 
 template <typename T>
 void MathUtils::MeanAndStdDev(const std::vector<T>& data_list, double* mean,
     double* std_dev) {
-  size_t N = data_list.size();
-
-  double sum = 0;
-  typename std::vector<T>::const_iterator it = data_list.begin();
-  for (; it != data_list.end(); ++it) {
-    sum += *it;
-  }
-  *mean = sum / N;
+  MeanAndStdDev(data_list.empty() ? NULL : &data_list[0], data_list.size(),
+      mean, std_dev);
+}
 
-  sum = 0;
-  it = data_list.begin();
-  for (; it != data_list.end(); ++it) {
-    sum += (*it - *mean) * (*it - *mean);
-  }
-  *std_dev = sqrt(sum / N);
+template <typename T>
+void MathUtils::MeanAndStdDev(const T* data, size_t n, double* mean,
+    double* std_dev) {
+  RunningStats stats;
+  stats.Push(data, n);
+  *mean = stats.mean();
+  *std_dev = stats.std_dev();
 }
 
 #endif
@@ -0,0 +1,164 @@
+// Copyright (c) 2010-2011, Tuji
+// All rights reserved.
+//
+// ${license}
+//
+// Author: LIU Yi
+
+#ifndef MATH_RANSAC_H_
+#define MATH_RANSAC_H_
+
+#include <algorithm>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "math/math.h"
+
+// Robust fitting of lines, affine transforms and homographies to point sets
+// with outliers by random sample consensus.
+//
+// M. A. Fischler and R. C. Bolles, "Random sample consensus: a paradigm for
+// model fitting with applications to image analysis and automated
+// cartography," Communications of the ACM, vol. 24, 1981, pp. 381-395.
+//
+// The points are copied once into contiguous arrays in random order, and every
+// hypothesis is scored on them 4 points at a time by comparing squared
+// residuals, so no sqrt or division is taken per point. Scoring stops as
+// soon as a hypothesis can not beat the best one, or, with SPRT, as soon as
+// it is likely bad. Hypotheses are generated and scored in batches split
+// into stripes for cv::parallel_for_, each from its own random stream, so
+// the result only depends on the seed and not on the number of stripes.
+class Ransac {
+ public:
+  enum Sampling {
+    // Minimal samples are drawn uniformly from all points
+    kUniformSampling,
+    // The points are sorted by decreasing quality, e.g. matching score, and
+    // samples are drawn from a growing set of the best points first.
+    //
+    // O. Chum and J. Matas, "Matching with PROSAC - progressive sample
+    // consensus," CVPR 2005, pp. 220-226.
+    kProsacSampling
+  };
+
+  Ransac();
+
+  // Maximum distance of an inlier to the line, or between the transformed
+  // source point and its destination point, in pixels
+  double threshold() const {
+    return threshold_;
+  }
+  void set_threshold(double threshold) {
+    CV_Assert(threshold > 0);
+    threshold_ = threshold;
+  }
+
+  // Probability that an all-inlier sample is drawn before stopping
+  double confidence() const {
+    return confidence_;
+  }
+  void set_confidence(double confidence) {
+    CV_Assert(confidence > 0 && confidence < 1);
+    confidence_ = confidence;
+  }
+
+  int max_iterations() const {
+    return max_iterations_;
+  }
+  void set_max_iterations(int max_iterations) {
+    max_iterations_ = std::max(max_iterations, 1);
+  }
+
+  Sampling sampling() const {
+    return sampling_;
+  }
+  void set_sampling(Sampling sampling) {
+    sampling_ = sampling;
+  }
+
+  // Reject bad hypotheses early by the sequential probability ratio test,
+  // which scores fewer points per hypothesis at the cost of a few more
+  // hypotheses.
+  //
+  // J. Matas and O. Chum, "Randomized RANSAC with sequential probability
+  // ratio test," ICCV 2005, pp. 1727-1732.
+  bool sprt() const {
+    return sprt_;
+  }
+  void set_sprt(bool sprt) {
+    sprt_ = sprt;
+  }
+
+  // Number of stripes each batch of hypotheses is split into, which bounds
+  // how many of the threads of OpenCV work on it at once. The threads
+  // themselves are set by cv::setNumThreads. 1 runs the batch on the calling
+  // thread.
+  int num_stripes() const {
+    return num_stripes_;
+  }
+  void set_num_stripes(int num_stripes) {
+    num_stripes_ = std::max(num_stripes, 1);
+  }
+
+  uint64_t seed() const {
+    return seed_;
+  }
+  void set_seed(uint64_t seed) {
+    seed_ = seed;
+  }
+
+  // Number of hypotheses generated by the last fit
+  int iterations() const {
+    return iterations_;
+  }
+
+  // Fit a line a * x + b * y + c = 0 with a^2 + b^2 = 1, so that
+  // MathUtils::Point2LineDist reduces to |a * x + b * y + c|. The line is
+  // refined by total least squares on the inliers.
+  //
+  // @param points at least 2
+  // @param line OUTPUT
+  // @param inliers OUTPUT, 1 for each inlier and 0 otherwise, ignored if NULL
+  // @return the number of inliers, 0 if every sample is degenerate
+  int FitLine(const std::vector<cv::Point2f>& points, cv::Vec3f* line,
+      std::vector<uchar>* inliers = NULL);
+
+  // Fit dst = A * [src; 1] refined by least squares on the inliers
+  //
+  // @param src at least 3
+  // @param dst the matches of src
+  // @param affine OUTPUT, 2x3 CV_64FC1
+  int FitAffine(const std::vector<cv::Point2f>& src,
+      const std::vector<cv::Point2f>& dst, cv::Mat* affine,
+      std::vector<uchar>* inliers = NULL);
+
+  // Fit dst ~ H * [src; 1] refined by the normalized DLT on the inliers
+  //
+  // @param src at least 4
+  // @param dst the matches of src
+  // @param homography OUTPUT, 3x3 CV_64FC1 with h33 = 1
+  int FitHomography(const std::vector<cv::Point2f>& src,
+      const std::vector<cv::Point2f>& dst, cv::Mat* homography,
+      std::vector<uchar>* inliers = NULL);
+
+ private:
+  double threshold_;
+  double confidence_;
+  int max_iterations_;
+  Sampling sampling_;
+  bool sprt_;
+  int num_stripes_;
+  uint64_t seed_;
+  int iterations_;
+
+  // Run the hypothesize-and-verify loop and the refinement for one of the
+  // model types defined in ransac.cc. model holds up to 9 coefficients in
+  // row-major order.
+  template <typename Model>
+  int Fit(const std::vector<cv::Point2f>& src,
+      const std::vector<cv::Point2f>& dst, double* model,
+      std::vector<uchar>* inliers);
+};
+
+#endif
@@ -7,45 +7,92 @@
 
 #include "common/common.h"
 
-#include <sys/stat.h>
-#include <dirent.h>
 #include <cstring>
 #include <cmath>
 #include <cassert>
+#include <cwchar>
+#include <stdint.h>
 
-#ifndef __MINGW32__
-#include <iconv.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
 #endif
 
 #include <iostream>
 #include <sstream>
 #include <algorithm>
 
+#include "common/dir_walker.h"
+
 using namespace std;
 
-string CmnUtils::Trim(const string& input) {
-  if (input.length() == 0) {
-    return string();
+const size_t StringPiece::npos;
+
+size_t StringPiece::find(char c, size_t pos) const {
+  if (pos >= size_) {
+    return npos;
   }
 
-  string::const_iterator it = input.begin();
-  string::const_iterator end = input.end();
-  for (; it != end && IsBlank(*it); ++it) {}
-  if (it == end) {
-    return string();
+  const void* found = memchr(data_ + pos, c, size_ - pos);
+  return (found == NULL) ? npos
+      : static_cast<const char*>(found) - data_;
+}
+
+size_t StringPiece::find(StringPiece s, size_t pos) const {
+  if (s.size_ == 0) {
+    return (pos <= size_) ? pos : npos;
   }
-  string::const_iterator start = it;
 
-  for (it = input.end() - 1; it != start && IsBlank(*it); --it) {}
+  // Candidates are found by memchr on the first character and checked by
+  // memcmp, which skips most of the input at vector speed
+  while (pos + s.size_ <= size_) {
+    const void* found = memchr(data_ + pos, s[0], size_ - s.size_ + 1 - pos);
+    if (found == NULL) {
+      return npos;
+    }
+    pos = static_cast<const char*>(found) - data_;
+    if (memcmp(data_ + pos + 1, s.data_ + 1, s.size_ - 1) == 0) {
+      return pos;
+    }
+    ++pos;
+  }
+  return npos;
+}
 
-  return string(start, it + 1);
+string CmnUtils::Trim(const string& input) {
+  return Trim(StringPiece(input)).ToString();
+}
+
+StringPiece CmnUtils::Trim(StringPiece input) {
+  const char* start = input.begin();
+  const char* end = input.end();
+  for (; start != end && IsBlank(*start); ++start) {}
+  for (; end != start && IsBlank(*(end - 1)); --end) {}
+
+  return StringPiece(start, end - start);
 }
 
 void CmnUtils::Split(const string& input, char delim, vector<string>* output) {
-  stringstream ss(input);
-  std::string item;
-  while (getline(ss, item, delim)) {
-    output->push_back(item);
+  StringSplitter fields(input, delim);
+  for (StringPiece field; fields.Next(&field); ) {
+    output->push_back(field.ToString());
+  }
+}
+
+void CmnUtils::Split(StringPiece input, char delim,
+    vector<StringPiece>* output) {
+  StringSplitter fields(input, delim);
+  for (StringPiece field; fields.Next(&field); ) {
+    output->push_back(field);
+  }
+}
+
+void CmnUtils::Split(StringPiece input, StringPiece delim,
+    vector<StringPiece>* output) {
+  assert(!delim.empty());
+
+  StringSplitter fields(input, delim);
+  for (StringPiece field; fields.Next(&field); ) {
+    output->push_back(field);
   }
 }
 
@@ -58,119 +105,276 @@ std::vector<std::string> &split(const std::string &s, char delim, std::vector<st
     return elems;
 }
 
+namespace {
+
+// Collect the entries of one kind reported by DirWalker
+class EntryCollector : public DirVisitor {
+ public:
+  EntryCollector(bool dirs, vector<string>* names) : dirs_(dirs),
+      names_(names) {}
+
+  void Visit(const string& path, bool is_dir) {
+    if (is_dir == dirs_) {
+      names_->push_back(path);
+    }
+  }
+
+ private:
+  bool dirs_;
+  vector<string>* names_;
+};
+
+}
+
 void CmnUtils::RetrieveFilenames(const string& dir_name, const string& suffix,
       vector<string>* filename_list, bool ignore_case) {
-  string complete_dir = dir_name;
-  if(complete_dir.at(complete_dir.length() - 1) != '/') {
-    complete_dir += '/';
+  DirWalker walker;
+  walker.set_num_threads(1);
+  walker.set_max_depth(0);
+  walker.AddSuffix(suffix, ignore_case);
+
+  EntryCollector collector(false, filename_list);
+  if (!walker.Walk(dir_name, &collector)) {
+    cerr << "Cannot open directory: " << dir_name << endl;
   }
+}
 
-  DIR* dir = opendir(complete_dir.c_str());
-  if (dir == NULL) {
-    cerr << "Cannot open directory: " << complete_dir << endl;
-    return;
+void CmnUtils::RetrieveDirNames(const string& dir_name,
+      vector<std::string>* dir_name_list) {
+  DirWalker walker;
+  walker.set_num_threads(1);
+  walker.set_max_depth(0);
+  walker.set_report_dirs(true);
+
+  EntryCollector collector(true, dir_name_list);
+  if (!walker.Walk(dir_name, &collector)) {
+    cerr << "Cannot open directory: " << dir_name << endl;
   }
+}
 
-  struct stat file_stat;
-  while (true) {
-    struct dirent* dirent = readdir(dir);
-    if (dirent == NULL) {
-      break;
-    }
-
-    string path = complete_dir + dirent->d_name;
-    int res = stat(path.c_str(), &file_stat);
-    assert(res == 0);
+namespace {
 
-    if (S_ISREG(file_stat.st_mode)) { // regular file
-      string filename(dirent->d_name);
+#if defined(__SSE2__) && WCHAR_MAX > 0xFFFF
+// Store 8 characters of 16 bits as wchar_t
+inline void StoreWide(__m128i chars, wchar_t* dst) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i* out = reinterpret_cast<__m128i*>(dst);
+  _mm_storeu_si128(out, _mm_unpacklo_epi16(chars, zero));
+  _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(chars, zero));
+}
 
-      string temp_suffix = filename.substr(filename.length() - suffix.length(),
-          suffix.length());
+// 16 ASCII bytes, or as many as there are before the first other byte,
+// whose count is returned. All 16 are stored unless there is none.
+inline int DecodeAscii(__m128i bytes, wchar_t* dst) {
+  int mask = _mm_movemask_epi8(bytes);
+  if (mask & 1) {
+    return 0;
+  }
+  const __m128i zero = _mm_setzero_si128();
+  StoreWide(_mm_unpacklo_epi8(bytes, zero), dst);
+  StoreWide(_mm_unpackhi_epi8(bytes, zero), dst + 8);
+  return (mask == 0) ? 16 : __builtin_ctz(mask);
+}
 
-      string suffix_target = suffix;
-      if(ignore_case) {
-        std::transform(temp_suffix.begin(), temp_suffix.end(),
-            temp_suffix.begin(), ::tolower);
+// 8 sequences of 2 bytes, U+0080 to U+07FF
+inline bool DecodeTwoBytes(__m128i bytes, wchar_t* dst) {
+  const __m128i pattern = _mm_and_si128(bytes, _mm_set1_epi16(
+      static_cast<short>(0xC0E0)));
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(pattern, _mm_set1_epi16(
+      static_cast<short>(0x80C0)))) != 0xFFFF) {
+    return false;
+  }
 
-        std::transform(suffix_target.begin(), suffix_target.end(),
-            suffix_target.begin(), ::tolower);
-      }
+  // Each 16-bit lane holds the lead byte low and the continuation high
+  __m128i chars = _mm_or_si128(
+      _mm_slli_epi16(_mm_and_si128(bytes, _mm_set1_epi16(0x1F)), 6),
+      _mm_and_si128(_mm_srli_epi16(bytes, 8), _mm_set1_epi16(0x3F)));
+  // Leads 0xC0 and 0xC1 give overlong forms
+  if (_mm_movemask_epi8(_mm_cmplt_epi16(chars, _mm_set1_epi16(0x80))) != 0) {
+    return false;
+  }
+  StoreWide(chars, dst);
+  return true;
+}
 
-      if (temp_suffix.compare(suffix_target) == 0) {
-        filename_list->push_back(filename);
-      }
-    }
+// 4 sequences of 3 bytes, U+0800 to U+FFFF without surrogates, in the first
+// 12 bytes
+inline bool DecodeThreeBytes(__m128i bytes, wchar_t* dst) {
+  const __m128i mask = _mm_setr_epi8(
+      static_cast<char>(0xF0), static_cast<char>(0xC0),
+      static_cast<char>(0xC0), static_cast<char>(0xF0),
+      static_cast<char>(0xC0), static_cast<char>(0xC0),
+      static_cast<char>(0xF0), static_cast<char>(0xC0),
+      static_cast<char>(0xC0), static_cast<char>(0xF0),
+      static_cast<char>(0xC0), static_cast<char>(0xC0), 0, 0, 0, 0);
+  const __m128i expected = _mm_setr_epi8(
+      static_cast<char>(0xE0), static_cast<char>(0x80),
+      static_cast<char>(0x80), static_cast<char>(0xE0),
+      static_cast<char>(0x80), static_cast<char>(0x80),
+      static_cast<char>(0xE0), static_cast<char>(0x80),
+      static_cast<char>(0x80), static_cast<char>(0xE0),
+      static_cast<char>(0x80), static_cast<char>(0x80), 0, 0, 0, 0);
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(bytes, mask),
+      expected)) != 0xFFFF) {
+    return false;
   }
 
-  closedir(dir);
+  // Shifting by k bytes moves sequence k from byte 3 * k into 32-bit lane k,
+  // lead byte lowest
+  __m128i lanes = _mm_or_si128(_mm_or_si128(
+      _mm_and_si128(bytes, _mm_setr_epi32(0xFFFFFF, 0, 0, 0)),
+      _mm_and_si128(_mm_slli_si128(bytes, 1),
+      _mm_setr_epi32(0, 0xFFFFFF, 0, 0))), _mm_or_si128(
+      _mm_and_si128(_mm_slli_si128(bytes, 2),
+      _mm_setr_epi32(0, 0, 0xFFFFFF, 0)),
+      _mm_and_si128(_mm_slli_si128(bytes, 3),
+      _mm_setr_epi32(0, 0, 0, 0xFFFFFF))));
+  __m128i chars = _mm_or_si128(_mm_or_si128(
+      _mm_slli_epi32(_mm_and_si128(lanes, _mm_set1_epi32(0x0F)), 12),
+      _mm_and_si128(_mm_srli_epi32(lanes, 2), _mm_set1_epi32(0xFC0))),
+      _mm_and_si128(_mm_srli_epi32(lanes, 16), _mm_set1_epi32(0x3F)));
+  __m128i invalid = _mm_or_si128(
+      _mm_cmplt_epi32(chars, _mm_set1_epi32(0x800)),
+      _mm_cmpeq_epi32(_mm_and_si128(chars, _mm_set1_epi32(0xF800)),
+      _mm_set1_epi32(0xD800)));
+  if (_mm_movemask_epi8(invalid) != 0) {
+    return false;
+  }
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), chars);
+  return true;
 }
+#endif
 
-void CmnUtils::RetrieveDirNames(const string& dir_name,
-      vector<std::string>* dir_name_list) {
-  string complete_dir = dir_name;
-  if(complete_dir.at(complete_dir.length() - 1) != '/') {
-    complete_dir += '/';
+// Decode one sequence at *src, or 0 if it is invalid or truncated
+inline uint32_t DecodeSequence(const unsigned char** src,
+    const unsigned char* end) {
+  const unsigned char* s = *src;
+  uint32_t c = s[0];
+  if (c < 0x80) {
+    *src = s + 1;
+    return c;
   }
 
-  DIR* dir = opendir(complete_dir.c_str());
-  if (dir == NULL) {
-    cerr << "Cannot open directory: " << complete_dir << endl;
-    return;
+  // Number of continuation bytes and the range of the first one, which
+  // rules out overlong forms, surrogates and values above U+10FFFF
+  int n;
+  unsigned char low = 0x80, high = 0xBF;
+  if (c < 0xC2) {
+    return 0;
+  } else if (c < 0xE0) {
+    n = 1;
+    c &= 0x1F;
+  } else if (c < 0xF0) {
+    n = 2;
+    low = (c == 0xE0) ? 0xA0 : 0x80;
+    high = (c == 0xED) ? 0x9F : 0xBF;
+    c &= 0x0F;
+  } else if (c < 0xF5) {
+    n = 3;
+    low = (c == 0xF0) ? 0x90 : 0x80;
+    high = (c == 0xF4) ? 0x8F : 0xBF;
+    c &= 0x07;
+  } else {
+    return 0;
   }
 
-  struct stat file_stat;
-  while (true) {
-    struct dirent* dirent = readdir(dir);
-    if (dirent == NULL) {
-      break;
+  if (end - s <= n || s[1] < low || s[1] > high) {
+    return 0;
+  }
+  for (int i = 1; i <= n; ++i) {
+    if ((s[i] & 0xC0) != 0x80) {
+      return 0;
     }
+    c = (c << 6) | (s[i] & 0x3F);
+  }
+  *src = s + n + 1;
+  return c;
+}
 
-    string path = complete_dir + dirent->d_name;
-    int res = stat(path.c_str(), &file_stat);
-    assert(res == 0);
+// @return the number of wchar_t written, -1 if src is invalid or dst is too
+//         short
+int DecodeUtf8(const unsigned char* src, const unsigned char* end,
+    wchar_t* dst, wchar_t* dst_end) {
+  wchar_t* const begin = dst;
+  while (src < end) {
+    const unsigned char* scalar_end = end;
+#if defined(__SSE2__) && WCHAR_MAX > 0xFFFF
+    if (end - src >= 16 && dst_end - dst >= 16) {
+      __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+      int ascii = DecodeAscii(bytes, dst);
+      if (ascii > 0) {
+        src += ascii;
+        dst += ascii;
+        continue;
+      }
+      if (DecodeTwoBytes(bytes, dst)) {
+        src += 16;
+        dst += 8;
+        continue;
+      }
+      if (DecodeThreeBytes(bytes, dst)) {
+        src += 12;
+        dst += 4;
+        continue;
+      }
+      // Mixed or 4-byte sequences, decode these bytes before trying again
+      scalar_end = src + 16;
+    }
+#endif
 
-    if (S_ISDIR(file_stat.st_mode)) {
-      string name(dirent->d_name);
-      if (name != "." && name != "..") {
-        dir_name_list->push_back(name);
+    while (src < scalar_end) {
+      // A NUL byte decodes to 0 like an error, so check the byte
+      bool nul = (*src == 0);
+      uint32_t c = DecodeSequence(&src, end);
+      if (c == 0 && !nul) {
+        return -1;
+      }
+#if WCHAR_MAX > 0xFFFF
+      if (dst == dst_end) {
+        return -1;
       }
+      *dst++ = static_cast<wchar_t>(c);
+#else
+      if (c < 0x10000) {
+        if (dst == dst_end) {
+          return -1;
+        }
+        *dst++ = static_cast<wchar_t>(c);
+      } else {
+        if (dst_end - dst < 2) {
+          return -1;
+        }
+        c -= 0x10000;
+        *dst++ = static_cast<wchar_t>(0xD800 | (c >> 10));
+        *dst++ = static_cast<wchar_t>(0xDC00 | (c & 0x3FF));
+      }
+#endif
     }
   }
+  return static_cast<int>(dst - begin);
+}
 
-  closedir(dir);
 }
 
-#ifndef __MINGW32__
 int CmnUtils::Utf8ToWChar(const char* src, int src_len, wchar_t* dst,
     int dst_len) {
-  const int utf8_unit_len = 3;
-  int char_num = src_len / utf8_unit_len;
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(src);
+  int res = DecodeUtf8(s, s + src_len, dst, dst + dst_len);
 
-  assert(char_num <= dst_len);
+  return (res >= 0) ? res : 0;
+}
 
-  const char* from_code = "UTF8";
-  const char* to_code = "WCHAR_T";
-  iconv_t cnv_type = iconv_open(to_code, from_code);
-  if (cnv_type == (iconv_t) - 1) {
-    assert(false);
+bool CmnUtils::Utf8ToWChar(StringPiece utf8, wstring* wchar) {
+  // A character never takes more wchar_t than bytes
+  wchar->resize(utf8.size());
+  if (utf8.empty()) {
+    return true;
   }
 
-  // Have to malloc space, for input src is const and iconv funcion does not
-  // allow char[]
-  char* from_char = new char[src_len];
-  memcpy(from_char, src, src_len * sizeof(char));
-  char* to_char = (char*) dst;
-
-  size_t s_len = static_cast<size_t>(src_len);
-  size_t d_len = static_cast<size_t>(char_num * sizeof(wchar_t));
-
-  char* bk = from_char;
-  int res = iconv(cnv_type, &from_char, &s_len, &to_char, &d_len);
-
-  delete[] bk;
-
-  return (res == 0) ? char_num : 0;
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(
+      utf8.data());
+  int res = DecodeUtf8(s, s + utf8.size(), &(*wchar)[0],
+      &(*wchar)[0] + wchar->size());
+  wchar->resize((res >= 0) ? res : 0);
+  return res >= 0;
 }
-#endif
-
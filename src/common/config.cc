@@ -15,62 +15,175 @@
 
 using namespace std;
 
+Config::Value::Value(const string& name, const string& text) : name(name),
+    text(text), present(true),
+    int_value(atoi(text.c_str())),
+    float_value(static_cast<float>(atof(text.c_str()))),
+    bool_value(text == "true" ? 1 : (text == "false" ? 0 : -1)) {}
+
+Config::Config() : file_path_("."), snapshot_(new Snapshot()) {}
+
+Config::Config(const char* file_path) : file_path_(file_path),
+    snapshot_(new Snapshot()) {}
+
+Config::~Config() {
+  delete snapshot_.load();
+  for (size_t i = 0; i < retired_.size(); ++i) {
+    delete retired_[i];
+  }
+}
+
 bool Config::Load() {
   ifstream in(file_path_.c_str());
   if (!in) {
     return false;
   }
 
-  string line;
-  while (getline(in, line)) {
-    line = CmnUtils::Trim(line);
-    if (line.length() == 0 || line[0] == '#') {
+  // Views into the line buffer, only the key and value are copied
+  Properties properties;
+  bool res = true;
+  string buffer;
+  while (getline(in, buffer)) {
+    StringPiece line = CmnUtils::Trim(StringPiece(buffer));
+    if (line.empty() || line[0] == '#') {
       continue;
     }
 
-    string::size_type pos = line.find_first_of("=");
-    if (pos == string::npos) {
-      return false;
+    size_t pos = line.find('=');
+    if (pos == StringPiece::npos) {
+      res = false;
+      break;
     }
 
-    string key = line.substr(0, pos);
-    key = CmnUtils::Trim(key);
-    string value = line.substr(pos + 1, line.length() - pos - 1);
-    value = CmnUtils::Trim(value);
+    StringPiece key = CmnUtils::Trim(line.substr(0, pos));
+    StringPiece value = CmnUtils::Trim(line.substr(pos + 1));
 
-    PutByForce(key, value);
+    properties.push_back(make_pair(key.ToString(), value.ToString()));
   }
 
-  return true;
+  Update(properties, kAssign);
+  return res;
 }
 
-bool Config::Put(string key, string value) {
-  pair<Properties::iterator, bool> res;
+bool Config::Put(const string& key, const string& value) {
+  return Update(Properties(1, make_pair(key, value)), kInsert) > 0;
+}
 
-  res = properties_.insert(make_pair(key, value));
+void Config::PutByForce(const string& key, const string& value) {
+  Update(Properties(1, make_pair(key, value)), kAssign);
+}
+
+bool Config::Exist(const string& key) const {
+  const Snapshot* snapshot = Current();
+  map<string, int>::const_iterator itr = snapshot->slots.find(key);
+  if (itr == snapshot->slots.end()) {
+    return false;
+  }
+  const Value& value = snapshot->values[itr->second];
+  return value.present && value.text.length() > 0;
+}
+
+bool Config::Change(const string& key, const string& value) {
+  return Update(Properties(1, make_pair(key, value)), kChange) > 0;
+}
+
+Config::Key Config::Resolve(const string& key) {
+  {
+    const Snapshot* snapshot = Current();
+    map<string, int>::const_iterator itr = snapshot->slots.find(key);
+    if (itr != snapshot->slots.end()) {
+      return Key(itr->second);
+    }
+  }
+
+  lock_guard<mutex> lock(update_lock_);
+  const Snapshot* current = Current();
+  map<string, int>::const_iterator itr = current->slots.find(key);
+  if (itr != current->slots.end()) {
+    return Key(itr->second);
+  }
 
-  return res.second;
+  // Publish an absent slot for the key
+  Snapshot* next = new Snapshot(*current);
+  int slot = static_cast<int>(next->values.size());
+  next->slots[key] = slot;
+  next->values.push_back(Value(key));
+  Publish(next);
+  return Key(slot);
+}
+
+Config::Key Config::Find(const string& key) const {
+  const Snapshot* snapshot = Current();
+  map<string, int>::const_iterator itr = snapshot->slots.find(key);
+  if (itr == snapshot->slots.end() || !snapshot->values[itr->second].present) {
+    assert(false);
+  }
+
+  return Key(itr->second);
+}
+
+int Config::Update(const Properties& properties, UpdateMode mode) {
+  lock_guard<mutex> lock(update_lock_);
+  const Snapshot* current = Current();
+  Snapshot* next = NULL;
+
+  int applied = 0;
+  for (size_t i = 0; i < properties.size(); ++i) {
+    const string& key = properties[i].first;
+    const Snapshot* latest = (next != NULL) ? next : current;
+    map<string, int>::const_iterator itr = latest->slots.find(key);
+    bool present = itr != latest->slots.end() &&
+        latest->values[itr->second].present;
+    bool exist = present && latest->values[itr->second].text.length() > 0;
+    if ((mode == kInsert && present) || (mode == kChange && !exist)) {
+      continue;
+    }
+
+    if (next == NULL) {
+      next = new Snapshot(*current);
+    }
+    int& slot = next->slots.insert(make_pair(key, -1)).first->second;
+    if (slot < 0) {
+      slot = static_cast<int>(next->values.size());
+      next->values.push_back(Value(key));
+    }
+    next->values[slot] = Value(key, properties[i].second);
+    ++applied;
+  }
+
+  if (next != NULL) {
+    Publish(next);
+  }
+  return applied;
+}
+
+void Config::Publish(const Snapshot* next) {
+  retired_.push_back(snapshot_.load(memory_order_relaxed));
+  snapshot_.store(next, memory_order_release);
 }
 
 void Config::Store() {
   ofstream ofs(file_path_.c_str());
 
-  for (Properties::iterator itr = properties_.begin(); itr != properties_.end();
-      itr++) {
-    ofs << itr->first << "=" << itr->second << endl;
+  const Snapshot* snapshot = Current();
+  for (map<string, int>::const_iterator itr = snapshot->slots.begin();
+      itr != snapshot->slots.end(); itr++) {
+    const Value& value = snapshot->values[itr->second];
+    if (value.present) {
+      ofs << itr->first << "=" << value.text << endl;
+    }
   }
 }
 
-bool Config::GetBool(std::string key) throw (std::string) {
-  std::string value = Get(key);
+bool Config::GetBool(Key key) const throw (std::string) {
+  const Value& value = Lookup(key);
+  assert(value.present);
 
-  if (value == "true") {
-    return true;
-  } else if (value == "false") {
-    return false;
+  if (value.bool_value >= 0) {
+    return value.bool_value == 1;
   } else {
     std::string str("ERROR: the value of key \"");
-    str += key + "\" is not bool";
+    str += value.name + "\" is not bool";
 
     throw str;
   }
@@ -0,0 +1,426 @@
+// Copyright (c) 2010-2011, Tuji
+// All rights reserved.
+//
+// ${license}
+//
+// Author: LIU Yi
+
+#include "common/dir_walker.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#include <cctype>
+#include <cstring>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+namespace {
+
+// A directory to list, relative to the root
+struct DirTask {
+  DirTask() : depth(0) {}
+  DirTask(const string& path, int depth) : path(path), depth(depth) {}
+
+  string path;
+  int depth;
+};
+
+// One queue of directories per thread. The owner pushes and pops at the back,
+// which walks depth first and keeps its queue short, and the others steal
+// from the front, which takes the directories closest to the root and so
+// most likely the largest subtrees. Threads without work sleep until a
+// directory is queued or the walk is finished.
+class WorkQueues {
+ public:
+  explicit WorkQueues(int n) : queues_(n), pending_(0), queued_(0),
+      waiting_(0) {}
+
+  void Push(int self, const DirTask& task) {
+    ++pending_;
+    {
+      Queue& queue = queues_[self];
+      lock_guard<mutex> lock(queue.lock);
+      queue.tasks.push_back(task);
+    }
+    ++queued_;
+    if (waiting_ > 0) {
+      lock_guard<mutex> lock(idle_lock_);
+      idle_.notify_one();
+    }
+  }
+
+  bool Pop(int self, DirTask* task) {
+    {
+      Queue& queue = queues_[self];
+      lock_guard<mutex> lock(queue.lock);
+      if (!queue.tasks.empty()) {
+        *task = queue.tasks.back();
+        queue.tasks.pop_back();
+        --queued_;
+        return true;
+      }
+    }
+
+    int n = static_cast<int>(queues_.size());
+    for (int i = 1; i < n; ++i) {
+      Queue& queue = queues_[(self + i) % n];
+      lock_guard<mutex> lock(queue.lock);
+      if (!queue.tasks.empty()) {
+        *task = queue.tasks.front();
+        queue.tasks.pop_front();
+        --queued_;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // A popped task is finished, after its subdirectories were pushed
+  void Done() {
+    if (--pending_ == 0) {
+      lock_guard<mutex> lock(idle_lock_);
+      idle_.notify_all();
+    }
+  }
+
+  bool Finished() const {
+    return pending_ == 0;
+  }
+
+  // Block until a task is queued or all are finished. waiting_ is raised
+  // before the check, so a Push either is seen by it or sees the waiter.
+  void Wait() {
+    unique_lock<mutex> lock(idle_lock_);
+    ++waiting_;
+    while (queued_ <= 0 && pending_ != 0) {
+      idle_.wait(lock);
+    }
+    --waiting_;
+  }
+
+ private:
+  struct Queue {
+    mutex lock;
+    deque<DirTask> tasks;
+  };
+
+  vector<Queue> queues_;
+  // Tasks queued or being listed
+  atomic<int64_t> pending_;
+  // Tasks queued only
+  atomic<int64_t> queued_;
+  atomic<int> waiting_;
+  mutex idle_lock_;
+  condition_variable idle_;
+};
+
+// Entries of an open directory, which is closed on destruction
+class DirReader {
+ public:
+#if defined(__linux__)
+  explicit DirReader(int fd) : fd_(fd), size_(0), pos_(0) {}
+  ~DirReader() {
+    close(fd_);
+  }
+#else
+  explicit DirReader(int fd) : fd_(fd), dir_(fdopendir(fd)) {
+    if (dir_ == NULL) {
+      close(fd_);
+    }
+  }
+  ~DirReader() {
+    if (dir_ != NULL) {
+      closedir(dir_);
+    }
+  }
+#endif
+
+  // @param type OUTPUT, DT_DIR, DT_REG, DT_LNK, DT_UNKNOWN, ...
+  // @return false after the last entry
+  bool Next(const char** name, unsigned char* type) {
+#if defined(__linux__)
+    // Layout of the records returned by getdents64
+    struct LinuxDirent64 {
+      uint64_t d_ino;
+      int64_t d_off;
+      unsigned short d_reclen;
+      unsigned char d_type;
+      char d_name[1];
+    };
+
+    if (pos_ >= size_) {
+      long size = syscall(SYS_getdents64, fd_, buffer_, sizeof(buffer_));
+      if (size <= 0) {
+        return false;
+      }
+      size_ = static_cast<size_t>(size);
+      pos_ = 0;
+    }
+    const LinuxDirent64* entry = reinterpret_cast<const LinuxDirent64*>(
+        reinterpret_cast<const char*>(buffer_) + pos_);
+    pos_ += entry->d_reclen;
+    *name = entry->d_name;
+    *type = entry->d_type;
+    return true;
+#else
+    struct dirent* entry = (dir_ != NULL) ? readdir(dir_) : NULL;
+    if (entry == NULL) {
+      return false;
+    }
+    *name = entry->d_name;
+    *type = entry->d_type;
+    return true;
+#endif
+  }
+
+  int fd() const {
+    return fd_;
+  }
+
+ private:
+  int fd_;
+#if defined(__linux__)
+  uint64_t buffer_[4096];
+  size_t size_;
+  size_t pos_;
+#else
+  DIR* dir_;
+#endif
+
+  DirReader(const DirReader&);
+  void operator=(const DirReader&);
+};
+
+// Matches s against p with '*' and '?', backtracking only to the last '*'
+bool GlobMatch(const char* p, size_t pn, const char* s, size_t sn) {
+  size_t pi = 0, si = 0;
+  size_t star = string::npos, mark = 0;
+  while (si < sn) {
+    if (pi < pn && (p[pi] == '?' || p[pi] == s[si])) {
+      ++pi;
+      ++si;
+    } else if (pi < pn && p[pi] == '*') {
+      star = pi++;
+      mark = si;
+    } else if (star != string::npos) {
+      pi = star + 1;
+      si = ++mark;
+    } else {
+      return false;
+    }
+  }
+  while (pi < pn && p[pi] == '*') {
+    ++pi;
+  }
+  return pi == pn;
+}
+
+class Walker {
+ public:
+  Walker(const DirWalker& config, int root_fd, DirVisitor* visitor)
+      : config_(config), root_fd_(root_fd), visitor_(visitor),
+        queues_(config.num_threads()) {
+    queues_.Push(0, DirTask("", 0));
+  }
+
+  void Run(int self) {
+    DirTask task;
+    while (true) {
+      if (queues_.Pop(self, &task)) {
+        List(self, task);
+        queues_.Done();
+      } else if (queues_.Finished()) {
+        break;
+      } else {
+        queues_.Wait();
+      }
+    }
+  }
+
+ private:
+  const DirWalker& config_;
+  int root_fd_;
+  DirVisitor* visitor_;
+  WorkQueues queues_;
+
+  void List(int self, const DirTask& task) {
+    int fd = openat(root_fd_, task.path.empty() ? "." : task.path.c_str(),
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+
+    DirReader reader(fd);
+    const bool descend = config_.max_depth() < 0 ||
+        task.depth < config_.max_depth();
+    string path = task.path;
+    if (!path.empty()) {
+      path += '/';
+    }
+    const size_t prefix = path.size();
+
+    const char* name;
+    unsigned char type;
+    while (reader.Next(&name, &type)) {
+      if (name[0] == '.' && (name[1] == '\0' ||
+          (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+
+      bool is_link = (type == DT_LNK);
+      if (type == DT_UNKNOWN || is_link) {
+        struct stat st;
+        if (fstatat(fd, name, &st, 0) != 0) {
+          continue;
+        }
+        type = S_ISDIR(st.st_mode) ? DT_DIR
+            : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+      }
+
+      size_t length = strlen(name);
+      if (type == DT_DIR) {
+        path.replace(prefix, string::npos, name, length);
+        if (config_.report_dirs()) {
+          visitor_->Visit(path, true);
+        }
+        if (descend && !is_link) {
+          queues_.Push(self, DirTask(path, task.depth + 1));
+        }
+      } else if (type == DT_REG && config_.Matches(name, length)) {
+        path.replace(prefix, string::npos, name, length);
+        visitor_->Visit(path, false);
+      }
+    }
+  }
+};
+
+}
+
+DirWalker::DirWalker() : any_ignore_case_(false), num_threads_(1),
+    max_depth_(-1), report_dirs_(false) {
+  set_num_threads(static_cast<int>(thread::hardware_concurrency()));
+}
+
+void DirWalker::AddSuffix(const string& suffix, bool ignore_case) {
+  Pattern compiled;
+  compiled.kind = Pattern::kSuffix;
+  compiled.ignore_case = ignore_case;
+  compiled.text = suffix;
+  if (ignore_case) {
+    transform(compiled.text.begin(), compiled.text.end(),
+        compiled.text.begin(), ::tolower);
+    any_ignore_case_ = true;
+  }
+  patterns_.push_back(compiled);
+}
+
+void DirWalker::AddPattern(const string& pattern, bool ignore_case) {
+  Pattern compiled;
+  compiled.ignore_case = ignore_case;
+  compiled.text = pattern;
+  if (ignore_case) {
+    transform(compiled.text.begin(), compiled.text.end(),
+        compiled.text.begin(), ::tolower);
+    any_ignore_case_ = true;
+  }
+
+  const string& text = compiled.text;
+  size_t stars = count(text.begin(), text.end(), '*');
+  if (text.find('?') != string::npos || stars > 1) {
+    compiled.kind = Pattern::kGlob;
+  } else if (stars == 0) {
+    compiled.kind = Pattern::kExact;
+  } else if (text[0] == '*') {
+    compiled.kind = Pattern::kSuffix;
+    compiled.text.erase(0, 1);
+  } else if (text[text.size() - 1] == '*') {
+    compiled.kind = Pattern::kPrefix;
+    compiled.text.erase(text.size() - 1);
+  } else {
+    compiled.kind = Pattern::kGlob;
+  }
+  patterns_.push_back(compiled);
+}
+
+bool DirWalker::Matches(const char* name, size_t length) const {
+  if (patterns_.empty()) {
+    return true;
+  }
+
+  // Names are at most NAME_MAX bytes, lowered once for all patterns
+  char buffer[256];
+  string lowered;
+  const char* lower = name;
+  if (any_ignore_case_) {
+    char* dst = buffer;
+    if (length >= sizeof(buffer)) {
+      lowered.resize(length);
+      dst = &lowered[0];
+    }
+    for (size_t i = 0; i < length; ++i) {
+      dst[i] = static_cast<char>(tolower(static_cast<unsigned char>(name[i])));
+    }
+    lower = dst;
+  }
+
+  for (size_t i = 0; i < patterns_.size(); ++i) {
+    const Pattern& pattern = patterns_[i];
+    const char* s = pattern.ignore_case ? lower : name;
+    const string& text = pattern.text;
+    bool match = false;
+    switch (pattern.kind) {
+      case Pattern::kExact:
+        match = length == text.size() &&
+            memcmp(s, text.data(), length) == 0;
+        break;
+      case Pattern::kPrefix:
+        match = length >= text.size() &&
+            memcmp(s, text.data(), text.size()) == 0;
+        break;
+      case Pattern::kSuffix:
+        match = length >= text.size() &&
+            memcmp(s + length - text.size(), text.data(), text.size()) == 0;
+        break;
+      case Pattern::kGlob:
+        match = GlobMatch(text.data(), text.size(), s, length);
+        break;
+    }
+    if (match) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool DirWalker::Walk(const string& root, DirVisitor* visitor) const {
+  int root_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd < 0) {
+    return false;
+  }
+
+  Walker walker(*this, root_fd, visitor);
+  vector<thread> threads;
+  for (int i = 1; i < num_threads_; ++i) {
+    threads.push_back(thread(&Walker::Run, &walker, i));
+  }
+  walker.Run(0);
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+
+  close(root_fd);
+  return true;
+}
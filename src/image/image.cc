@@ -7,6 +7,7 @@
 
 #include "image/image.h"
 
+#include <climits>
 #include <stack>
 
 #include <opencv2/imgproc/imgproc.hpp>
@@ -214,6 +215,160 @@ void ImgUtils::Thin(const Mat& binary, Mat* dst) {
   roi.copyTo(*dst);
 }
 
+namespace {
+
+const int kInfDist = INT_MAX;
+
+// 1D squared distance transform of the sampled function f, computed as the
+// lower envelope of the parabolas rooted at the finite samples. Samples equal
+// to kInfDist take no part in the envelope.
+//
+// @param v buffer of n sites
+// @param z buffer of n + 1 envelope boundaries
+void DistTrans1D(const int* f, int n, int* d, int* arg, int* v, double* z) {
+  int k = -1;
+  for (int q = 0; q < n; ++q) {
+    if (f[q] == kInfDist) continue;
+
+    double fq = f[q] + static_cast<double>(q) * q;
+    double s = -DBL_MAX;
+    while (k >= 0) {
+      int p = v[k];
+      s = (fq - (f[p] + static_cast<double>(p) * p)) / (2.0 * (q - p));
+      if (s > z[k]) break;
+      --k;
+    }
+    ++k;
+    v[k] = q;
+    z[k] = (k == 0) ? -DBL_MAX : s;
+  }
+
+  if (k < 0) {
+    for (int q = 0; q < n; ++q) {
+      d[q] = kInfDist;
+      arg[q] = -1;
+    }
+    return;
+  }
+
+  z[k + 1] = DBL_MAX;
+  int j = 0;
+  for (int q = 0; q < n; ++q) {
+    while (z[j + 1] < q) ++j;
+    int p = v[j];
+    d[q] = (q - p) * (q - p) + f[p];
+    arg[q] = p;
+  }
+}
+
+// Columns gathered at a time by ColumnDistTrans, so that each row of the
+// output block is one cache line of ints
+const int kDistColumnBlock = 16;
+
+// The columns are processed by blocks, which are gathered row by row into
+// contiguous column buffers and scattered back the same way, so the images
+// are only ever read and written along rows.
+class ColumnDistTrans : public ParallelLoopBody {
+ public:
+  ColumnDistTrans(const Mat& binary, Mat* sqdist, Mat* nearest_row)
+      : binary_(binary), sqdist_(sqdist), nearest_row_(nearest_row) {}
+
+  // @param range blocks of kDistColumnBlock columns
+  void operator()(const Range& range) const {
+    const int n = binary_.rows;
+    const int kBlock = kDistColumnBlock;
+    vector<int> f(kBlock * n), d(kBlock * n), arg(kBlock * n), v(n);
+    vector<double> z(n + 1);
+
+    for (int b = range.start; b < range.end; ++b) {
+      const int x0 = b * kBlock;
+      const int w = std::min(kBlock, binary_.cols - x0);
+
+      for (int y = 0; y < n; ++y) {
+        const uchar* src = binary_.ptr<uchar>(y) + x0;
+        for (int j = 0; j < w; ++j) {
+          f[j * n + y] = (src[j] == 0) ? 0 : kInfDist;
+        }
+      }
+
+      for (int j = 0; j < w; ++j) {
+        DistTrans1D(&f[j * n], n, &d[j * n], &arg[j * n], &v[0], &z[0]);
+      }
+
+      for (int y = 0; y < n; ++y) {
+        int* sqdist = sqdist_->ptr<int>(y) + x0;
+        int* nearest_row = nearest_row_->ptr<int>(y) + x0;
+        for (int j = 0; j < w; ++j) {
+          sqdist[j] = d[j * n + y];
+          nearest_row[j] = arg[j * n + y];
+        }
+      }
+    }
+  }
+
+ private:
+  const Mat& binary_;
+  Mat* sqdist_;
+  Mat* nearest_row_;
+};
+
+class RowDistTrans : public ParallelLoopBody {
+ public:
+  RowDistTrans(const Mat& sqdist, const Mat& nearest_row, Mat* dist,
+      Mat* nearest) : sqdist_(sqdist), nearest_row_(nearest_row), dist_(dist),
+      nearest_(nearest) {}
+
+  void operator()(const Range& range) const {
+    int n = sqdist_.cols;
+    vector<int> d(n), arg(n), v(n);
+    vector<double> z(n + 1);
+
+    for (int y = range.start; y < range.end; ++y) {
+      DistTrans1D(sqdist_.ptr<int>(y), n, &d[0], &arg[0], &v[0], &z[0]);
+
+      float* dist_row = dist_->ptr<float>(y);
+      for (int x = 0; x < n; ++x) {
+        dist_row[x] = (d[x] == kInfDist) ? FLT_MAX
+            : std::sqrt(static_cast<float>(d[x]));
+      }
+
+      if (nearest_ != NULL) {
+        const int* row_idx = nearest_row_.ptr<int>(y);
+        int* nearest_row = nearest_->ptr<int>(y);
+        for (int x = 0; x < n; ++x) {
+          nearest_row[x] = (arg[x] < 0) ? -1 : row_idx[arg[x]] * n + arg[x];
+        }
+      }
+    }
+  }
+
+ private:
+  const Mat& sqdist_;
+  const Mat& nearest_row_;
+  Mat* dist_;
+  Mat* nearest_;
+};
+
+}
+
+void ImgUtils::DistanceTransform(const Mat& binary, Mat* dist, Mat* nearest) {
+  CV_Assert(dist != NULL && binary.type() == CV_8UC1);
+  // Keeps the squared distances, at most rows^2 + cols^2, inside int
+  CV_Assert(binary.rows < 32768 && binary.cols < 32768);
+
+  Mat sqdist(binary.size(), CV_32SC1);
+  Mat nearest_row(binary.size(), CV_32SC1);
+  parallel_for_(Range(0, (binary.cols + kDistColumnBlock - 1) /
+      kDistColumnBlock), ColumnDistTrans(binary, &sqdist, &nearest_row));
+
+  dist->create(binary.size(), CV_32FC1);
+  if (nearest != NULL) {
+    nearest->create(binary.size(), CV_32SC1);
+  }
+  parallel_for_(Range(0, binary.rows),
+      RowDistTrans(sqdist, nearest_row, dist, nearest));
+}
+
 void ImgUtils::RemoveNoise(Mat* binary) {
   const uchar kBG = 0;
 
@@ -305,3 +460,145 @@ void ImgUtils::FillRect(Mat* binary, const Rect& rect, uchar src, uchar dst) {
     }
   }
 }
+
+namespace {
+
+// Accumulate one integral image. The running sum along a row is the only
+// serial dependency; adding the previous row is a plain element-wise loop
+// which the compiler vectorizes.
+template <typename SrcT, typename SumT, bool kSquare>
+void BuildIntegral(const Mat& src, Mat* dst, int type) {
+  dst->create(src.rows + 1, src.cols + 1, type);
+
+  SumT* top = dst->ptr<SumT>(0);
+  for (int x = 0; x <= src.cols; ++x) {
+    top[x] = 0;
+  }
+
+  for (int y = 0; y < src.rows; ++y) {
+    const SrcT* src_row = src.ptr<SrcT>(y);
+    const SumT* prev = dst->ptr<SumT>(y) + 1;
+    SumT* cur = dst->ptr<SumT>(y + 1);
+
+    cur[0] = 0;
+    ++cur;
+    SumT run = 0;
+    for (int x = 0; x < src.cols; ++x) {
+      SumT v = static_cast<SumT>(src_row[x]);
+      run += kSquare ? v * v : v;
+      cur[x] = run;
+    }
+    for (int x = 0; x < src.cols; ++x) {
+      cur[x] += prev[x];
+    }
+  }
+}
+
+template <typename SumT>
+double CornerSum(const Mat& sum, const Rect& rect) {
+  const SumT* top = sum.ptr<SumT>(rect.y);
+  const SumT* bottom = sum.ptr<SumT>(rect.y + rect.height);
+  int x1 = rect.x;
+  int x2 = rect.x + rect.width;
+  return static_cast<double>(bottom[x2]) - bottom[x1] - top[x2] + top[x1];
+}
+
+double CornerSum(const Mat& sum, const Rect& rect) {
+  return (sum.type() == CV_32SC1) ? CornerSum<int>(sum, rect)
+      : CornerSum<double>(sum, rect);
+}
+
+bool IsInsideIntegral(const Mat& sum, const Rect& rect) {
+  return rect.x >= 0 && rect.y >= 0 && rect.width >= 0 && rect.height >= 0
+      && rect.x + rect.width < sum.cols && rect.y + rect.height < sum.rows;
+}
+
+template <typename SumT, typename SqSumT>
+void BatchRectStats(const Mat& sum, const Mat& sqsum,
+    const vector<Rect>& rects, vector<double>* mean,
+    vector<double>* variance) {
+  for (size_t i = 0; i < rects.size(); ++i) {
+    const Rect& rect = rects[i];
+    CV_Assert(IsInsideIntegral(sum, rect));
+
+    double area = rect.area();
+    double m = (area > 0) ? CornerSum<SumT>(sum, rect) / area : 0;
+    if (mean != NULL) (*mean)[i] = m;
+
+    if (variance != NULL) {
+      double var = (area > 0) ? CornerSum<SqSumT>(sqsum, rect) / area - m * m
+          : 0;
+      (*variance)[i] = (var > 0) ? var : 0;
+    }
+  }
+}
+
+}
+
+void ImgUtils::Integral(const Mat& gray, Mat* sum, Mat* sqsum) {
+  CV_Assert(sum != NULL && (gray.type() == CV_8UC1 || gray.type() == CV_32FC1));
+
+  if (gray.type() == CV_32FC1) {
+    BuildIntegral<float, double, false>(gray, sum, CV_64FC1);
+    if (sqsum != NULL) {
+      BuildIntegral<float, double, true>(gray, sqsum, CV_64FC1);
+    }
+    return;
+  }
+
+  const double n = static_cast<double>(gray.rows) * gray.cols;
+  if (255.0 * n <= INT_MAX) {
+    BuildIntegral<uchar, int, false>(gray, sum, CV_32SC1);
+  } else {
+    BuildIntegral<uchar, double, false>(gray, sum, CV_64FC1);
+  }
+
+  if (sqsum != NULL) {
+    if (255.0 * 255.0 * n <= INT_MAX) {
+      BuildIntegral<uchar, int, true>(gray, sqsum, CV_32SC1);
+    } else {
+      BuildIntegral<uchar, double, true>(gray, sqsum, CV_64FC1);
+    }
+  }
+}
+
+double ImgUtils::RectSum(const Mat& sum, const Rect& rect) {
+  CV_Assert(IsInsideIntegral(sum, rect));
+  return CornerSum(sum, rect);
+}
+
+double ImgUtils::RectVariance(const Mat& sum, const Mat& sqsum,
+    const Rect& rect) {
+  CV_Assert(IsInsideIntegral(sum, rect) && sum.size() == sqsum.size());
+
+  double area = rect.area();
+  if (area <= 0) {
+    return 0;
+  }
+
+  double mean = CornerSum(sum, rect) / area;
+  double var = CornerSum(sqsum, rect) / area - mean * mean;
+  return (var > 0) ? var : 0;
+}
+
+void ImgUtils::RectStats(const Mat& sum, const Mat& sqsum,
+    const vector<Rect>& rects, vector<double>* mean,
+    vector<double>* variance) {
+  CV_Assert(variance == NULL || sum.size() == sqsum.size());
+
+  if (mean != NULL) mean->resize(rects.size());
+  if (variance != NULL) variance->resize(rects.size());
+
+  // Resolve the accumulator types once for the whole batch
+  bool sum32 = (sum.type() == CV_32SC1);
+  bool sqsum32 = (variance == NULL || sqsum.type() == CV_32SC1);
+  if (sum32 && sqsum32) {
+    BatchRectStats<int, int>(sum, sqsum, rects, mean, variance);
+  } else if (sum32) {
+    BatchRectStats<int, double>(sum, sqsum, rects, mean, variance);
+  } else if (sqsum32) {
+    BatchRectStats<double, int>(sum, sqsum, rects, mean, variance);
+  } else {
+    BatchRectStats<double, double>(sum, sqsum, rects, mean, variance);
+  }
+}
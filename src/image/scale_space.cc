@@ -7,7 +7,15 @@
 
 #include "image/scale_space.h"
 
+#include <cfloat>
 #include <cmath>
+#include <complex>
+
+#include <atomic>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <opencv2/imgproc/imgproc.hpp>
 
@@ -17,6 +25,8 @@ using namespace std;
 using namespace cv;
 
 const double ScaleSpace::Param::kDefaultSigma = 1.6;
+const double ScaleSpace::kDefaultMinContrast = 0.1;
+const double ScaleSpace::kDefaultEdgeRatio = 10;
 
 ScaleSpace::ScaleSpace() {
   ScaleSpace::Param param;
@@ -38,6 +48,27 @@ ScaleSpace::ScaleSpace(int O, int S, int omin, int smin, double sigma) :
 
   max_edge_response_ = DoGMaxResp(sigmak_);
 
+  num_threads_ = std::max(getNumThreads(), 1);
+
+  blur_method_ = kFIRBlur;
+  storage_type_ = kFloatStorage;
+  lazy_ = false;
+
+  InitBuffer();
+  InitFilters();
+}
+
+ScaleSpace::ScaleSpace(const ScaleSpace* prototype) :
+    base_filter_(prototype->base_filter_),
+    level_filter_(prototype->level_filter_), O_(prototype->O_),
+    S_(prototype->S_), omin_(prototype->omin_), smin_(prototype->smin_),
+    smax_(prototype->smax_), sigman_(prototype->sigman_),
+    sigma_(prototype->sigma_), sigmak_(prototype->sigmak_),
+    sigma0_(prototype->sigma0_),
+    max_edge_response_(prototype->max_edge_response_), num_threads_(1),
+    blur_method_(prototype->blur_method_),
+    storage_type_(prototype->storage_type_), lazy_(prototype->lazy_) {
+  // The filters are copied above as headers, so their kernels are shared
   InitBuffer();
 }
 
@@ -48,6 +79,85 @@ void ScaleSpace::InitBuffer() {
     octave_[i] = new Mat[smax_ - smin_ + 1];
     extrema_map_[i] = new Mat[smax_ - smin_ - 2];
   }
+
+  blur_buffer_.resize(O_);
+  band_scratch_.resize(O_);
+  dog_.resize(smax_ - smin_);
+
+  n_ready_levels_.assign(O_, 0);
+  extrema_ready_.assign(O_ * (smax_ - smin_ - 2), false);
+
+  grad_mag_.resize(O_ * (smax_ - smin_ + 1));
+  grad_ori_.resize(O_ * (smax_ - smin_ + 1));
+  grad_ready_.assign(O_ * (smax_ - smin_ + 1), false);
+}
+
+void ScaleSpace::InitFilters() {
+  double sa = sigma0_ * pow(sigmak_, smin_);
+  double sb = sigman_ / pow(2.0, omin_); // review this
+  if (sa > sb) {
+    base_filter_ = GaussianFilter(sqrt(sa*sa - sb*sb));
+  }
+
+  level_filter_.resize(smax_ - smin_ + 1);
+
+  int sbest = min(smin_ + S_, smax_);
+  sb = sigma0_ * pow(sigmak_, sbest - S_);
+  if (sa > sb) {
+    level_filter_[0] = GaussianFilter(sqrt(sa*sa - sb*sb));
+  }
+
+  double dsigma0 = sigma0_ * sqrt(1.0 - 1.0/(sigmak_*sigmak_));
+  for (int s = smin_ + 1; s <= smax_; ++s) {
+    level_filter_[s - smin_] = GaussianFilter(dsigma0 * pow(sigmak_, s));
+  }
+}
+
+ScaleSpace::GaussianFilter::GaussianFilter(double sigma) : sigma(sigma) {
+  // The same aperture GaussianBlur chooses for float images
+  int ksize = cvRound(sigma * 4 * 2 + 1) | 1;
+  kernel = getGaussianKernel(ksize, sigma, CV_32F);
+
+  // Poles of the recursive filter fitted to a Gaussian of sigma 2 under the
+  // max norm, scaled to sigma by d^(1/q) with q chosen to match the variance
+  // sum(2 d / (d - 1)^2) of the causal and anti-causal pair.
+  //
+  // L. J. van Vliet, I. T. Young, P. W. Verbeek, "Recursive Gaussian
+  // derivative filters," Proc. ICPR, 1998, pp. 509-514.
+  const double real_pole = 2.42913;
+  const complex<double> complex_pole(1.33674, 1.70319);
+
+  double q = sigma / 2;
+  double d1 = 0;
+  complex<double> d2;
+  for (int i = 0; i < 20; ++i) {
+    d1 = pow(real_pole, 1 / q);
+    d2 = exp(log(complex_pole) / q);
+    double var = 2 * d1 / ((d1 - 1) * (d1 - 1))
+        + 4 * (d2 / ((d2 - 1.0) * (d2 - 1.0))).real();
+
+    // Newton step on var(q) = sigma^2 with a numerical derivative
+    double h = q * 1e-6;
+    double d1h = pow(real_pole, 1 / (q + h));
+    complex<double> d2h = exp(log(complex_pole) / (q + h));
+    double var_h = 2 * d1h / ((d1h - 1) * (d1h - 1))
+        + 4 * (d2h / ((d2h - 1.0) * (d2h - 1.0))).real();
+    double step = (var - sigma * sigma) / ((var_h - var) / h);
+    q -= step;
+    if (fabs(step) < q * 1e-9) break;
+  }
+
+  // w[n] = B x[n] + c1 w[n-1] + c2 w[n-2] + c3 w[n-3], where the c are the
+  // coefficients of (1 - z^-1/d1)(1 - z^-1/d2)(1 - z^-1/conj(d2))
+  double r1 = 1 / d1;
+  complex<double> r2 = 1.0 / d2;
+  double c1 = r1 + 2 * r2.real();
+  double c2 = -(norm(r2) + 2 * r1 * r2.real());
+  double c3 = r1 * norm(r2);
+  coeffs[0] = static_cast<float>(1 - (c1 + c2 + c3));
+  coeffs[1] = static_cast<float>(c1);
+  coeffs[2] = static_cast<float>(c2);
+  coeffs[3] = static_cast<float>(c3);
 }
 
 ScaleSpace::~ScaleSpace() {
@@ -68,125 +178,1692 @@ ScaleSpace::~ScaleSpace() {
   extrema_map_ = NULL;
 }
 
+namespace {
+
+// Value of 1.0 in kFixedStorage
+const float kFixedOne = 65535;
+
+// Carve an image with aligned rows out of the block at *ptr
+Mat TakePlane(Size size, int type, int align, uchar** ptr) {
+  size_t step = alignSize(size.width * CV_ELEM_SIZE(type), align);
+  Mat plane(size, type, *ptr, step);
+  *ptr += step * size.height;
+  return plane;
+}
+
+size_t PlaneBytes(Size size, int type, int align) {
+  return alignSize(size.width * CV_ELEM_SIZE(type), align) * size.height;
+}
+
+}
+
+void ScaleSpace::Preallocate(Size input_size) {
+  const int n_levels = smax_ - smin_ + 1;
+  const int n_maps = smax_ - smin_ - 2;
+  const int n_dog = smax_ - smin_;
+
+  // Octave sizes as produced by MakePyramidBase and MakeOctaves
+  vector<Size> octave_size(O_);
+  octave_size[0] = ScaleSize(input_size, pow(2.0, -omin_));
+  for (int i = 1; i < O_; ++i) {
+    octave_size[i] = ScaleSize(octave_size[i - 1], 0.5);
+  }
+
+  // A row per band for the decimating filters, three for the upsampler
+  vector<Size> scratch_size(O_);
+  for (int i = 0; i < O_; ++i) {
+    const int rows_per_band = (i == 0 && omin_ < 0) ? 3 : 1;
+    scratch_size[i] = Size(rows_per_band * octave_size[i].width,
+        num_threads_);
+  }
+
+  const int type = level_type();
+  size_t total = PlaneBytes(input_size, type, kAlign)
+      + n_dog * PlaneBytes(octave_size[0], CV_32FC1, kAlign);
+  for (int i = 0; i < O_; ++i) {
+    total += n_levels * PlaneBytes(octave_size[i], type, kAlign)
+        + (n_maps + 1) * PlaneBytes(octave_size[i], CV_32FC1, kAlign)
+        + PlaneBytes(scratch_size[i], CV_32FC1, kAlign);
+  }
+
+  storage_.create(1, static_cast<int>(total + kAlign), CV_8UC1);
+  uchar* ptr = alignPtr(storage_.data, kAlign);
+
+  input_ = TakePlane(input_size, type, kAlign, &ptr);
+  for (int i = 0; i < O_; ++i) {
+    for (int j = 0; j < n_levels; ++j) {
+      octave_[i][j] = TakePlane(octave_size[i], type, kAlign, &ptr);
+    }
+    for (int j = 0; j < n_maps; ++j) {
+      extrema_map_[i][j] = TakePlane(octave_size[i], CV_32FC1, kAlign, &ptr);
+    }
+    blur_buffer_[i] = TakePlane(octave_size[i], CV_32FC1, kAlign, &ptr);
+    band_scratch_[i] = TakePlane(scratch_size[i], CV_32FC1, kAlign, &ptr);
+  }
+  for (int j = 0; j < n_dog; ++j) {
+    dog_[j] = TakePlane(octave_size[0], CV_32FC1, kAlign, &ptr);
+  }
+
+  dog_rows_.resize(3 * octave_size[0].width);
+}
+
 void ScaleSpace::Build(const Mat& img) {
   if (img.empty() || img.type() != CV_8UC1) {
     CV_Error(CV_StsBadArg, "img is empty or has incorrect type");
   }
 
-  Mat fimg;
-  img.convertTo(fimg, CV_32FC1, 1.0/255);
+  img.convertTo(input_, level_type(), (storage_type_ == kFixedStorage)
+      ? kFixedOne / 255 : 1.0 / 255);
+
+  n_ready_levels_.assign(O_, 0);
+  extrema_ready_.assign(extrema_ready_.size(), false);
+  grad_ready_.assign(grad_ready_.size(), false);
 
-  MakePyramidBase(fimg);
-  MakeOctaves();
+  if (!lazy_) {
+    MakeOctaves();
+  }
 }
 
-void ScaleSpace::MakePyramidBase(const Mat& fimg) {
+void ScaleSpace::MakePyramidBase(const Mat& fimg) const {
+  Mat* base = &octave_[0][0];
+  if (omin_ > 0) {
+    // The decimation is fused with the first pass of the blur
+    Blur(fimg, base, base_filter_, 0, 1 << omin_);
+    return;
+  }
+
   if (omin_ < 0) {
-    Upsample(fimg, octave_[0], 2);
+    Upsample(fimg, base, 1 << -omin_, 0);
+  } else {
+    fimg.copyTo(*base);
+  }
+  Blur(*base, base, base_filter_, 0);
+}
 
-    for (int o = -1; o > omin_; --o) {
-      Upsample(octave_[0][0], octave_[0], 2);
+class ScaleSpace::OctaveStep : public ParallelLoopBody {
+ public:
+  // Level t - i * lead, counted from smin_, of each octave index i in range
+  OctaveStep(const ScaleSpace* space, int t, int lead) : space_(space), t_(t),
+      lead_(lead) {}
+
+  void operator()(const Range& range) const {
+    for (int i = range.start; i < range.end; ++i) {
+      const int o = space_->omin_ + i;
+      const int j = t_ - i * lead_;
+      if (j == 0) {
+        space_->MakeOctaveBase(o);
+      } else {
+        space_->MakeOctaveLevel(o, space_->smin_ + j);
+      }
     }
-  } else if (omin_ > 0) {
-    Downsample(fimg, octave_[0], 1 << omin_);
-  } else {
-    octave_[0][0] = fimg.clone();
   }
 
-  double sa = sigma0_ * pow(sigmak_, smin_);
-  double sb = sigman_ / pow(2.0, omin_); // review this
-  if (sa > sb) {
-    double sd = sqrt(sa*sa - sb*sb);
-    GaussianBlur(octave_[0][0], octave_[0][0], Size(0, 0), sd);
+ private:
+  const ScaleSpace* space_;
+  int t_;
+  int lead_;
+};
+
+void ScaleSpace::MakeOctaves() {
+  if (num_threads_ <= 1 || O_ == 1) {
+    for (int o = omin_; o < omin_ + O_; ++o) {
+      MakeOctave(o);
+    }
+    return;
   }
+
+  // Octave index i starts lead steps after i - 1, once the level its base is
+  // downsampled from was made. The octaves of a step use their own buffers,
+  // and the bands of their blurs nest in the same parallel_for_.
+  const int n_levels = smax_ - smin_ + 1;
+  const int lead = min(smin_ + S_, smax_) - smin_ + 1;
+  for (int t = 0; t < (O_ - 1) * lead + n_levels; ++t) {
+    const int first = max(0, (t - n_levels + lead) / lead);
+    const int last = min(O_ - 1, t / lead);
+    OctaveStep step(this, t, lead);
+    if (first == last) {
+      step(Range(first, last + 1));
+    } else {
+      parallel_for_(Range(first, last + 1), step, last - first + 1);
+    }
+  }
+
+  n_ready_levels_.assign(O_, n_levels);
 }
 
-void ScaleSpace::MakeOctaves() {
-  double dsigma0 = sigma0_ * sqrt(1.0 - 1.0/(sigmak_*sigmak_));
+void ScaleSpace::EnsureLevels(int o, int n) const {
+  CV_Assert(omin_ <= o && o < omin_ + O_ && 0 < n && n <= smax_ - smin_ + 1);
 
-  for (int o = omin_; o < omin_ + O_; ++o) {
-    // Prepare octave base
+  int& ready = n_ready_levels_[o - omin_];
+  if (ready >= n) {
+    return;
+  }
+
+  if (ready == 0) {
     if (o > omin_) {
       int sbest = min(smin_ + S_, smax_);
-      Downsample(*GetOctaveLevelPtr(o - 1, sbest),
-          GetOctaveLevelPtr(o, smin_), 2);
+      EnsureLevels(o - 1, sbest - smin_ + 1);
+    }
+    MakeOctaveBase(o);
+    ready = 1;
+  }
+
+  for (; ready < n; ++ready) {
+    MakeOctaveLevel(o, smin_ + ready);
+  }
+}
+
+void ScaleSpace::MakeOctave(int o) {
+  MakeOctaveBase(o);
+  for (int s = smin_ + 1; s <= smax_; ++s) {
+    MakeOctaveLevel(o, s);
+  }
+
+  n_ready_levels_[o - omin_] = smax_ - smin_ + 1;
+}
+
+void ScaleSpace::MakeOctaveBase(int o) const {
+  if (o == omin_) {
+    MakePyramidBase(input_);
+    return;
+  }
+
+  int sbest = min(smin_ + S_, smax_);
+  Blur(*GetOctaveLevelPtr(o - 1, sbest), GetOctaveLevelPtr(o, smin_),
+      level_filter_[0], o - omin_, 2);
+}
+
+void ScaleSpace::MakeOctaveLevel(int o, int s) const {
+  Blur(*GetOctaveLevelPtr(o, s - 1), GetOctaveLevelPtr(o, s),
+      level_filter_[s - smin_], o - omin_);
+}
+
+namespace {
+
+// Mirror an out-of-range index like BORDER_REFLECT_101
+inline int Reflect101(int i, int n) {
+  if (n == 1) {
+    return 0;
+  }
+  while (i < 0 || i >= n) {
+    i = (i < 0) ? -i : 2 * n - 2 - i;
+  }
+  return i;
+}
+
+// dst[x] = src[x * factor] for x < n
+template <typename T>
+void DecimateRow(const T* src, int factor, int n, T* dst) {
+  for (int x = 0; x < n; ++x) {
+    dst[x] = src[x * factor];
+  }
+}
+
+#if defined(__SSE2__)
+// The even elements of two vectors are shuffled into one. A row of n
+// decimated elements comes from at least 2 n - 1 source elements, so the
+// loads stay inside the source row.
+template <>
+void DecimateRow<float>(const float* src, int factor, int n, float* dst) {
+  int x = 0;
+  if (factor == 2) {
+    for (; x + 4 < n; x += 4) {
+      __m128 a = _mm_loadu_ps(src + 2 * x);
+      __m128 b = _mm_loadu_ps(src + 2 * x + 4);
+      _mm_storeu_ps(dst + x, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+    }
+  }
+  for (; x < n; ++x) {
+    dst[x] = src[x * factor];
+  }
+}
+
+// The even 16-bit elements are sign extended to 32 bits, which the signed
+// pack restores bit for bit
+template <>
+void DecimateRow<ushort>(const ushort* src, int factor, int n, ushort* dst) {
+  int x = 0;
+  if (factor == 2) {
+    for (; x + 8 < n; x += 8) {
+      __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+          src + 2 * x));
+      __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+          src + 2 * x + 8));
+      a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+      b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x),
+          _mm_packs_epi32(a, b));
+    }
+  }
+  for (; x < n; ++x) {
+    dst[x] = src[x * factor];
+  }
+}
+#endif
 
-      double sa = sigma0_ * pow(sigmak_, smin_);
-      double sb = sigma0_ * pow(sigmak_, sbest - S_);
-      if (sa > sb) {
-        double sd = sqrt(sa*sa - sb*sb);
-        GaussianBlur(*GetOctaveLevelPtr(o, 0), *GetOctaveLevelPtr(o, 0),
-            Size(0, 0), sd);
+// Round a float row into T like saturate_cast. Nothing is done when src and
+// dst are the same.
+inline void StoreRow(const float* src, int n, float* dst) {
+  if (src != dst) {
+    std::copy(src, src + n, dst);
+  }
+}
+
+inline void StoreRow(const float* src, int n, ushort* dst) {
+  int x = 0;
+#if defined(__SSE2__)
+  // Clamp, round to nearest even as cvRound does, and pack through the
+  // signed range
+  const __m128 lo = _mm_setzero_ps();
+  const __m128 hi = _mm_set1_ps(65535.0f);
+  const __m128i bias = _mm_set1_epi32(32768);
+  const __m128i flip = _mm_set1_epi16(static_cast<short>(0x8000));
+  for (; x + 8 <= n; x += 8) {
+    __m128i a = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(
+        _mm_loadu_ps(src + x), lo), hi));
+    __m128i b = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(
+        _mm_loadu_ps(src + x + 4), lo), hi));
+    __m128i packed = _mm_packs_epi32(_mm_sub_epi32(a, bias),
+        _mm_sub_epi32(b, bias));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x),
+        _mm_xor_si128(packed, flip));
+  }
+#endif
+  for (; x < n; ++x) {
+    dst[x] = saturate_cast<ushort>(src[x]);
+  }
+}
+
+// Horizontal pass of a symmetric kernel from SrcT into float. The interior
+// loops run over x for each tap so that they vectorize. With a stride above
+// 1, the rows and columns of src are decimated by it on the fly, one row at a
+// time into the band scratch, so that the filter still runs over contiguous
+// elements.
+template <typename SrcT>
+class RowFilter {
+ public:
+  RowFilter(const Mat& src, Mat* dst, const Mat& kernel, int stride = 1)
+      : src_(src), dst_(dst), kernel_(kernel), stride_(stride) {}
+
+  int scratch_size() const {
+    return (stride_ > 1) ? dst_->cols : 0;
+  }
+
+  void operator()(const Range& range, float* scratch) const {
+    const int cols = dst_->cols;
+    const int r = static_cast<int>(kernel_.total()) / 2;
+    const float* k = kernel_.ptr<float>() + r;
+    const int x_begin = std::min(r, cols);
+    const int x_end = std::max(cols - r, x_begin);
+    SrcT* row = reinterpret_cast<SrcT*>(scratch);
+
+    for (int y = range.start; y < range.end; ++y) {
+      const SrcT* s = src_.ptr<SrcT>(y * stride_);
+      if (stride_ > 1) {
+        DecimateRow(s, stride_, cols, row);
+        s = row;
+      }
+      float* d = dst_->ptr<float>(y);
+
+      for (int x = x_begin; x < x_end; ++x) {
+        d[x] = k[0] * s[x];
+      }
+      for (int i = 1; i <= r; ++i) {
+        const float ki = k[i];
+        for (int x = x_begin; x < x_end; ++x) {
+          d[x] += ki * (static_cast<float>(s[x - i]) + s[x + i]);
+        }
+      }
+
+      for (int x = 0; x < cols; ++x) {
+        if (x == x_begin) x = x_end;
+        if (x >= cols) break;
+
+        float sum = k[0] * s[x];
+        for (int i = 1; i <= r; ++i) {
+          sum += k[i] * (static_cast<float>(s[Reflect101(x - i, cols)])
+              + s[Reflect101(x + i, cols)]);
+        }
+        d[x] = sum;
       }
     }
+  }
 
-    // Make other levels
-    for (int s = smin_ + 1; s <= smax_; ++s) {
-      double sd = dsigma0 * pow(sigmak_, s);
-      GaussianBlur(*GetOctaveLevelPtr(o, s - 1), *GetOctaveLevelPtr(o, s),
-          Size(0, 0), sd);
+ private:
+  const Mat& src_;
+  Mat* dst_;
+  const Mat& kernel_;
+  int stride_;
+};
+
+// Vertical pass of a symmetric kernel from float into DstT. Each row is
+// accumulated in float over chunks of columns and rounded to DstT once.
+template <typename DstT>
+class ColumnFilter : public ParallelLoopBody {
+ public:
+  ColumnFilter(const Mat& src, Mat* dst, const Mat& kernel) : src_(src),
+      dst_(dst), kernel_(kernel) {}
+
+  void operator()(const Range& range) const {
+    const int kChunk = 256;
+    const int rows = src_.rows;
+    const int cols = src_.cols;
+    const int r = static_cast<int>(kernel_.total()) / 2;
+    const float* k = kernel_.ptr<float>() + r;
+    float acc[kChunk];
+
+    for (int y = range.start; y < range.end; ++y) {
+      DstT* d = dst_->ptr<DstT>(y);
+      for (int x0 = 0; x0 < cols; x0 += kChunk) {
+        const int n = std::min(kChunk, cols - x0);
+        const float* s = src_.ptr<float>(y) + x0;
+        for (int x = 0; x < n; ++x) {
+          acc[x] = k[0] * s[x];
+        }
+
+        for (int i = 1; i <= r; ++i) {
+          const float ki = k[i];
+          const float* up = src_.ptr<float>(Reflect101(y - i, rows)) + x0;
+          const float* down = src_.ptr<float>(Reflect101(y + i, rows)) + x0;
+          for (int x = 0; x < n; ++x) {
+            acc[x] += ki * (up[x] + down[x]);
+          }
+        }
+
+        StoreRow(acc, n, d + x0);
+      }
+    }
+  }
+
+ private:
+  const Mat& src_;
+  Mat* dst_;
+  const Mat& kernel_;
+};
+
+// Horizontal recursive Gaussian from SrcT into float, causal then
+// anti-causal along each row. The borders start from the steady state of a
+// replicated edge pixel. src is decimated by stride as in RowFilter.
+template <typename SrcT>
+class RecursiveRowFilter {
+ public:
+  RecursiveRowFilter(const Mat& src, Mat* dst, const float* coeffs,
+      int stride = 1) : src_(src), dst_(dst), coeffs_(coeffs),
+      stride_(stride) {}
+
+  int scratch_size() const {
+    return (stride_ > 1) ? dst_->cols : 0;
+  }
+
+  void operator()(const Range& range, float* scratch) const {
+    const int cols = dst_->cols;
+    const float b = coeffs_[0];
+    const float a1 = coeffs_[1];
+    const float a2 = coeffs_[2];
+    const float a3 = coeffs_[3];
+    SrcT* row = reinterpret_cast<SrcT*>(scratch);
+
+    for (int y = range.start; y < range.end; ++y) {
+      const SrcT* s = src_.ptr<SrcT>(y * stride_);
+      if (stride_ > 1) {
+        DecimateRow(s, stride_, cols, row);
+        s = row;
+      }
+      float* d = dst_->ptr<float>(y);
+
+      float w1 = s[0], w2 = s[0], w3 = s[0];
+      for (int x = 0; x < cols; ++x) {
+        float w = b * s[x] + a1 * w1 + a2 * w2 + a3 * w3;
+        d[x] = w;
+        w3 = w2;
+        w2 = w1;
+        w1 = w;
+      }
+
+      w1 = w2 = w3 = d[cols - 1];
+      for (int x = cols - 2; x >= 0; --x) {
+        float w = b * d[x] + a1 * w1 + a2 * w2 + a3 * w3;
+        d[x] = w;
+        w3 = w2;
+        w2 = w1;
+        w1 = w;
+      }
+    }
+  }
+
+ private:
+  const Mat& src_;
+  Mat* dst_;
+  const float* coeffs_;
+  int stride_;
+};
+
+// Vertical recursive Gaussian over the columns in range. Whole row segments
+// are updated at once, so the recursion is vectorized across columns. The
+// recursion needs float precision, so src and dst are CV_32FC1 and may be the
+// same; the final rows are also rounded into fixed_dst unless it is NULL.
+class RecursiveColumnFilter : public ParallelLoopBody {
+ public:
+  RecursiveColumnFilter(const Mat& src, Mat* dst, const float* coeffs,
+      Mat* fixed_dst = NULL) : src_(src), dst_(dst), coeffs_(coeffs),
+      fixed_dst_(fixed_dst) {}
+
+  void operator()(const Range& range) const {
+    const int rows = src_.rows;
+    const int x0 = range.start;
+    const int n = range.end - range.start;
+    const float b = coeffs_[0];
+    const float a1 = coeffs_[1];
+    const float a2 = coeffs_[2];
+    const float a3 = coeffs_[3];
+
+    // Causal pass, rows above the image hold the steady state of the first
+    // source row
+    const float* first = src_.ptr<float>(0) + x0;
+    for (int y = 0; y < rows; ++y) {
+      const float* s = src_.ptr<float>(y) + x0;
+      const float* w1 = (y >= 1) ? dst_->ptr<float>(y - 1) + x0 : first;
+      const float* w2 = (y >= 2) ? dst_->ptr<float>(y - 2) + x0 : first;
+      const float* w3 = (y >= 3) ? dst_->ptr<float>(y - 3) + x0 : first;
+      float* d = dst_->ptr<float>(y) + x0;
+      for (int x = 0; x < n; ++x) {
+        d[x] = b * s[x] + a1 * w1[x] + a2 * w2[x] + a3 * w3[x];
+      }
+    }
+
+    // Anti-causal pass in place. The steady state of the last row is the
+    // row itself, so it stays unchanged and serves as the boundary.
+    const float* last = dst_->ptr<float>(rows - 1) + x0;
+    StoreFixed(last, rows - 1, x0, n);
+    for (int y = rows - 2; y >= 0; --y) {
+      const float* w1 = dst_->ptr<float>(y + 1) + x0;
+      const float* w2 = (y + 2 < rows) ? dst_->ptr<float>(y + 2) + x0 : last;
+      const float* w3 = (y + 3 < rows) ? dst_->ptr<float>(y + 3) + x0 : last;
+      float* d = dst_->ptr<float>(y) + x0;
+      for (int x = 0; x < n; ++x) {
+        d[x] = b * d[x] + a1 * w1[x] + a2 * w2[x] + a3 * w3[x];
+      }
+      StoreFixed(d, y, x0, n);
+    }
+  }
+
+ private:
+  const Mat& src_;
+  Mat* dst_;
+  const float* coeffs_;
+  Mat* fixed_dst_;
+
+  void StoreFixed(const float* row, int y, int x0, int n) const {
+    if (fixed_dst_ != NULL) {
+      StoreRow(row, n, fixed_dst_->ptr<ushort>(y) + x0);
+    }
+  }
+};
+
+// Runs a band body on bands [range.start, range.end) of n_bands equal parts
+// of rows, each band with its own row of scratch
+template <typename Body>
+class BandRunner : public ParallelLoopBody {
+ public:
+  BandRunner(const Range& rows, int n_bands, const Body& body, Mat* scratch)
+      : rows_(rows), n_bands_(n_bands), body_(body), scratch_(scratch) {}
+
+  void operator()(const Range& range) const {
+    const int64 n = rows_.end - rows_.start;
+    for (int b = range.start; b < range.end; ++b) {
+      Range band(rows_.start + static_cast<int>(n * b / n_bands_),
+          rows_.start + static_cast<int>(n * (b + 1) / n_bands_));
+      if (band.start < band.end) {
+        body_(band, scratch_->empty() ? NULL : scratch_->ptr<float>(b));
+      }
+    }
+  }
+
+ private:
+  Range rows_;
+  int n_bands_;
+  const Body& body_;
+  Mat* scratch_;
+};
+
+}
+
+template <typename Body>
+void ScaleSpace::RunBands(const Range& range, const Body& body, int i) const {
+  const int n_bands = std::max(std::min(num_threads_, range.size()), 1);
+
+  // Only grows when num_threads_ or the size differ from Preallocate
+  Mat* scratch = &band_scratch_[i];
+  const int size = body.scratch_size();
+  if (size > 0 && (scratch->rows < n_bands || scratch->cols < size)) {
+    scratch->create(std::max(scratch->rows, n_bands),
+        std::max(scratch->cols, size), CV_32FC1);
+  }
+
+  BandRunner<Body> runner(range, n_bands, body, scratch);
+  if (n_bands <= 1) {
+    runner(Range(0, 1));
+  } else {
+    parallel_for_(Range(0, n_bands), runner, n_bands);
+  }
+}
+
+void ScaleSpace::Blur(const Mat& src, Mat* dst, const GaussianFilter& filter,
+    int i, int stride) const {
+  if (filter.sigma <= 0) {
+    if (stride > 1) {
+      Downsample(src, dst, stride);
+    } else if (dst->data != src.data) {
+      src.copyTo(*dst);
+    }
+    return;
+  }
+
+  CV_Assert(src.type() == CV_32FC1 || src.type() == CV_16UC1);
+  CV_Assert(stride == 1 || dst->data != src.data);
+  const bool fixed = src.type() == CV_16UC1;
+  const Size size = ScaleSize(src.size(), 1.0 / stride);
+
+  Mat* buffer = &blur_buffer_[i];
+  buffer->create(size, CV_32FC1);
+  if (blur_method_ == kRecursiveBlur && filter.sigma >= 0.5) {
+    if (fixed) {
+      RunBands(Range(0, size.height),
+          RecursiveRowFilter<ushort>(src, buffer, filter.coeffs, stride), i);
+      dst->create(size, CV_16UC1);
+      RunBands(Range(0, size.width),
+          RecursiveColumnFilter(*buffer, buffer, filter.coeffs, dst));
+    } else {
+      RunBands(Range(0, size.height),
+          RecursiveRowFilter<float>(src, buffer, filter.coeffs, stride), i);
+      dst->create(size, CV_32FC1);
+      RunBands(Range(0, size.width),
+          RecursiveColumnFilter(*buffer, dst, filter.coeffs));
+    }
+  } else {
+    if (fixed) {
+      RunBands(Range(0, size.height),
+          RowFilter<ushort>(src, buffer, filter.kernel, stride), i);
+      dst->create(size, CV_16UC1);
+      RunBands(Range(0, size.height),
+          ColumnFilter<ushort>(*buffer, dst, filter.kernel));
+    } else {
+      RunBands(Range(0, size.height),
+          RowFilter<float>(src, buffer, filter.kernel, stride), i);
+      dst->create(size, CV_32FC1);
+      RunBands(Range(0, size.height),
+          ColumnFilter<float>(*buffer, dst, filter.kernel));
     }
   }
 }
 
+void ScaleSpace::RunBands(const Range& range, const ParallelLoopBody& body) const {
+  if (num_threads_ <= 1) {
+    body(range);
+  } else {
+    parallel_for_(range, body, num_threads_);
+  }
+}
+
 void ScaleSpace::GenerateExtremaMap() {
-  Mat** dog = GenerateDoG();
+  CV_Assert(!input_.empty());
+
+  for (int o = omin_; o < omin_ + O_; ++o) {
+    EnsureExtremaMaps(o, 0, smax_ - smin_ - 2);
+  }
+}
+
+void ScaleSpace::EnsureExtremaMaps(int o, int j_begin, int j_end) const {
+  const int i = o - omin_;
+  const int n_maps = smax_ - smin_ - 2;
+
+  // Narrow the range to the maps not ready yet
+  while (j_begin < j_end && extrema_ready_[i * n_maps + j_begin]) ++j_begin;
+  while (j_begin < j_end && extrema_ready_[i * n_maps + j_end - 1]) --j_end;
+  if (j_begin == j_end) {
+    return;
+  }
+
+  // Map j compares the DoG layers j, j + 1 and j + 2
+  EnsureLevels(o, j_end + 3);
+  MakeExtremaMaps(i, j_begin, j_end);
+  for (int j = j_begin; j < j_end; ++j) {
+    extrema_ready_[i * n_maps + j] = true;
+  }
+}
+
+void ScaleSpace::MakeExtremaMaps(int i, int j_begin, int j_end) const {
+  const Mat* level = octave_[i];
+  const int rows = level[0].rows;
+  const int cols = level[0].cols;
+
+  for (int j = j_begin; j < j_end; ++j) {
+    extrema_map_[i][j].create(level[0].size(), CV_32FC1);
+  }
+
+  // Rolling buffer of the three DoG rows around the current map
+  if (dog_rows_.size() < 3 * static_cast<size_t>(cols)) {
+    dog_rows_.resize(3 * cols);
+  }
+  for (int y = 0; y < rows; ++y) {
+    float* down = &dog_rows_[0];
+    float* mid = &dog_rows_[cols];
+    float* up = &dog_rows_[2 * cols];
+    SubtractLevelRows(level[j_begin + 1], level[j_begin], y, down);
+    SubtractLevelRows(level[j_begin + 2], level[j_begin + 1], y, mid);
+
+    for (int j = j_begin; j < j_end; ++j) {
+      SubtractLevelRows(level[j + 3], level[j + 2], y, up);
+
+      float* ext = extrema_map_[i][j].ptr<float>(y);
+      for (int x = 0; x < cols; ++x) {
+        bool monotonic = (up[x] > mid[x] && mid[x] > down[x])
+            || (down[x] > mid[x] && mid[x] > up[x]);
+        ext[x] = monotonic ? 0 : mid[x];
+      }
+
+      float* recycled = down;
+      down = mid;
+      mid = up;
+      up = recycled;
+    }
+  }
+}
+
+namespace {
+
+template <typename T>
+void SubtractRow(const T* a, const T* b, int n, float scale, float* dst) {
+  for (int x = 0; x < n; ++x) {
+    dst[x] = (static_cast<float>(a[x]) - static_cast<float>(b[x])) * scale;
+  }
+}
+
+}
+
+void ScaleSpace::SubtractLevelRows(const Mat& a, const Mat& b, int y,
+    float* dst) const {
+  if (a.type() == CV_16UC1) {
+    SubtractRow(a.ptr<ushort>(y), b.ptr<ushort>(y), a.cols, 1 / kFixedOne,
+        dst);
+  } else {
+    SubtractRow(a.ptr<float>(y), b.ptr<float>(y), a.cols, 1.0f, dst);
+  }
+}
+
+void ScaleSpace::DetectKeypoints(vector<vector<Keypoint> >* keypoints,
+    double min_contrast, double edge_ratio) const {
+  CV_Assert(keypoints != NULL && !input_.empty());
+  std::lock_guard<std::mutex> lock(query_lock_);
+
+  const int n_dog = smax_ - smin_;
+  for (int o = omin_; o < omin_ + O_; ++o) {
+    EnsureLevels(o, n_dog + 1);
+  }
+  const float threshold = static_cast<float>(min_contrast * max_edge_response_);
+
+  keypoints->assign(O_, vector<Keypoint>());
+  vector<Mat> dog(n_dog);
   for (int i = 0; i < O_; ++i) {
-    for (int j = 0; j < smax_ - smin_ - 2; ++j) {
-      extrema_map_[i][j].create(dog[i][j + 1].size(), CV_32FC1);
-
-      MatIterator_<float> up_it = dog[i][j + 2].begin<float>();
-      MatIterator_<float> mid_it = dog[i][j + 1].begin<float>();
-      MatIterator_<float> down_it = dog[i][j].begin<float>();
-      MatIterator_<float> ext_it = extrema_map_[i][j].begin<float>();
-      MatIterator_<float> ext_end = extrema_map_[i][j].end<float>();
-
-      for (; ext_it != ext_end; ++up_it, ++mid_it, ++down_it, ++ext_it) {
-        if ((*up_it > *mid_it && *mid_it > *down_it)
-            || (*down_it > *mid_it && *mid_it > *up_it)) {
-          *ext_it = 0;
-        } else {
-          *ext_it = *mid_it;
+    const Mat* level = octave_[i];
+    for (int j = 0; j < n_dog; ++j) {
+      // The layers are sized for the first octave and reused by the others
+      if (dog_[j].rows < level[0].rows || dog_[j].cols < level[0].cols) {
+        dog_[j].create(level[0].size(), CV_32FC1);
+      }
+      dog[j] = dog_[j](Rect(0, 0, level[0].cols, level[0].rows));
+      for (int y = 0; y < level[0].rows; ++y) {
+        SubtractLevelRows(level[j + 1], level[j], y, dog[j].ptr<float>(y));
+      }
+    }
+
+    FindExtrema(dog, i + omin_, threshold, edge_ratio, &(*keypoints)[i]);
+  }
+}
+
+namespace {
+
+const int kMaxRefineSteps = 5;
+
+// Solve the symmetric 3x3 system h * x = b by Cramer's rule
+bool Solve3x3(const float h[3][3], const float b[3], float x[3]) {
+  double det = h[0][0] * (h[1][1] * h[2][2] - h[1][2] * h[2][1])
+      - h[0][1] * (h[1][0] * h[2][2] - h[1][2] * h[2][0])
+      + h[0][2] * (h[1][0] * h[2][1] - h[1][1] * h[2][0]);
+  if (MathUtils::IsDouble0(det)) {
+    return false;
+  }
+
+  for (int i = 0; i < 3; ++i) {
+    float m[3][3];
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 3; ++c) {
+        m[r][c] = (c == i) ? b[r] : h[r][c];
+      }
+    }
+    double det_i = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+        - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+        + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    x[i] = static_cast<float>(det_i / det);
+  }
+
+  return true;
+}
+
+// Fit a quadratic around the candidate (x, y) of DoG layer j, moving to the
+// neighbor sample while the offset exceeds half a sample. The derivatives
+// use the same stencils as MathUtils::CalcHessian.
+//
+// @param pos OUTPUT, refined x, y and layer index
+// @return false if the candidate drifts away, has low contrast or lies on
+//         an edge
+bool RefineExtremum(const vector<Mat>& dog, int j, int y, int x,
+    float threshold, double edge_ratio, float pos[3], float* response) {
+  const int n_dog = static_cast<int>(dog.size());
+  const int rows = dog[0].rows;
+  const int cols = dog[0].cols;
+
+  float grad[3];
+  float hessian[3][3];
+  float offset[3];
+  const float* cur = NULL;
+  for (int step = 0; ; ++step) {
+    if (step == kMaxRefineSteps) {
+      return false;
+    }
+
+    const int w = static_cast<int>(dog[j].step1());
+    const float* prev = dog[j - 1].ptr<float>(y) + x;
+    const float* next = dog[j + 1].ptr<float>(y) + x;
+    cur = dog[j].ptr<float>(y) + x;
+
+    grad[0] = (cur[1] - cur[-1]) * 0.5f;
+    grad[1] = (cur[w] - cur[-w]) * 0.5f;
+    grad[2] = (next[0] - prev[0]) * 0.5f;
+
+    float v2 = cur[0] * 2;
+    hessian[0][0] = cur[1] + cur[-1] - v2;
+    hessian[1][1] = cur[w] + cur[-w] - v2;
+    hessian[2][2] = next[0] + prev[0] - v2;
+    hessian[0][1] = hessian[1][0] =
+        (cur[w + 1] - cur[w - 1] - cur[-w + 1] + cur[-w - 1]) * 0.25f;
+    hessian[0][2] = hessian[2][0] =
+        (next[1] - next[-1] - prev[1] + prev[-1]) * 0.25f;
+    hessian[1][2] = hessian[2][1] =
+        (next[w] - next[-w] - prev[w] + prev[-w]) * 0.25f;
+
+    float neg_grad[3] = {-grad[0], -grad[1], -grad[2]};
+    if (!Solve3x3(hessian, neg_grad, offset)) {
+      return false;
+    }
+
+    if (fabs(offset[0]) < 0.5f && fabs(offset[1]) < 0.5f
+        && fabs(offset[2]) < 0.5f) {
+      break;
+    }
+    if (fabs(offset[0]) > cols || fabs(offset[1]) > rows
+        || fabs(offset[2]) > n_dog) {
+      return false;
+    }
+
+    x += cvRound(offset[0]);
+    y += cvRound(offset[1]);
+    j += cvRound(offset[2]);
+    if (j < 1 || j > n_dog - 2 || x < 1 || x >= cols - 1 || y < 1
+        || y >= rows - 1) {
+      return false;
+    }
+  }
+
+  float contrast = cur[0] + 0.5f
+      * (grad[0] * offset[0] + grad[1] * offset[1] + grad[2] * offset[2]);
+  if (fabs(contrast) < threshold) {
+    return false;
+  }
+
+  // Reject edges by the ratio of principal curvatures,
+  // tr^2 / det < (r + 1)^2 / r
+  double tr = hessian[0][0] + hessian[1][1];
+  double det = hessian[0][0] * hessian[1][1] - hessian[0][1] * hessian[1][0];
+  if (det <= 0 || tr * tr * edge_ratio >= (edge_ratio + 1) * (edge_ratio + 1)
+      * det) {
+    return false;
+  }
+
+  pos[0] = x + offset[0];
+  pos[1] = y + offset[1];
+  pos[2] = j + offset[2];
+  *response = contrast;
+  return true;
+}
+
+}
+
+void ScaleSpace::FindExtrema(const vector<Mat>& dog, int o, float threshold,
+    double edge_ratio, vector<Keypoint>* keypoints) const {
+  const int n_dog = static_cast<int>(dog.size());
+  const int rows = dog[0].rows;
+  const int cols = dog[0].cols;
+  const int w = static_cast<int>(dog[0].step1());
+  // Candidates have to pass half of the threshold before interpolation
+  const float prethreshold = threshold * 0.5f;
+  const float scale = static_cast<float>(pow(2.0, o));
+
+  const int neighbor[9] = {-w - 1, -w, -w + 1, -1, 0, 1, w - 1, w, w + 1};
+
+  vector<int> candidate;
+  candidate.reserve(cols);
+  for (int j = 1; j < n_dog - 1; ++j) {
+    for (int y = 1; y < rows - 1; ++y) {
+      const float* layer[3] = {dog[j - 1].ptr<float>(y),
+          dog[j].ptr<float>(y), dog[j + 1].ptr<float>(y)};
+      const float* cur = layer[1];
+
+      candidate.clear();
+      int x = 1;
+#if defined(__SSE2__)
+      const __m128 pos_thr = _mm_set1_ps(prethreshold);
+      const __m128 neg_thr = _mm_set1_ps(-prethreshold);
+      for (; x + 4 <= cols - 1; x += 4) {
+        __m128 v = _mm_loadu_ps(cur + x);
+        __m128 vmax = _mm_set1_ps(-FLT_MAX);
+        __m128 vmin = _mm_set1_ps(FLT_MAX);
+        for (int l = 0; l < 3; ++l) {
+          for (int n = 0; n < 9; ++n) {
+            if (l == 1 && neighbor[n] == 0) continue;
+            __m128 u = _mm_loadu_ps(layer[l] + x + neighbor[n]);
+            vmax = _mm_max_ps(vmax, u);
+            vmin = _mm_min_ps(vmin, u);
+          }
+        }
+
+        __m128 is_max = _mm_and_ps(_mm_cmpgt_ps(v, vmax),
+            _mm_cmpgt_ps(v, pos_thr));
+        __m128 is_min = _mm_and_ps(_mm_cmplt_ps(v, vmin),
+            _mm_cmplt_ps(v, neg_thr));
+        int mask = _mm_movemask_ps(_mm_or_ps(is_max, is_min));
+        for (int b = 0; mask != 0; ++b, mask >>= 1) {
+          if (mask & 1) candidate.push_back(x + b);
+        }
+      }
+#endif
+      for (; x < cols - 1; ++x) {
+        float v = cur[x];
+        if (v <= prethreshold && v >= -prethreshold) continue;
+
+        bool is_max = v > 0;
+        bool is_min = v < 0;
+        for (int l = 0; l < 3 && (is_max || is_min); ++l) {
+          for (int n = 0; n < 9; ++n) {
+            if (l == 1 && neighbor[n] == 0) continue;
+            float u = layer[l][x + neighbor[n]];
+            is_max = is_max && v > u;
+            is_min = is_min && v < u;
+          }
+        }
+        if (is_max || is_min) candidate.push_back(x);
+      }
+
+      for (size_t c = 0; c < candidate.size(); ++c) {
+        float pos[3];
+        Keypoint kp;
+        if (!RefineExtremum(dog, j, y, candidate[c], threshold, edge_ratio,
+            pos, &kp.response)) {
+          continue;
+        }
+
+        kp.x = pos[0];
+        kp.y = pos[1];
+        kp.s = smin_ + pos[2];
+        kp.pt = Point2f(kp.x * scale, kp.y * scale);
+        kp.sigma = static_cast<float>(GetScaleFromIndex(o, kp.s));
+        kp.angle = 0;
+        keypoints->push_back(kp);
+      }
+    }
+  }
+}
+
+namespace {
+
+const int kOrientationBins = 36;
+const int kMaxOrientations = 4;
+const float kOrientationPeakRatio = 0.8f;
+// Gaussian window of the orientation histogram, relative to the scale
+const float kOrientationSigma = 1.5f;
+const int kDescriptorWidth = 4;
+const int kDescriptorBins = 8;
+// Side of a descriptor cell, relative to the scale
+const float kDescriptorMagnification = 3;
+const float kDescriptorClamp = 0.2f;
+const float kTwoPi = static_cast<float>(2 * CV_PI);
+
+// Central difference gradient of the rows in range, with the kernel of
+// ImgUtils::Gradient and replicated borders, as magnitude and orientation in
+// [0, 2 pi). scale maps the level values to [0, 1].
+template <typename T>
+class PolarGradient : public ParallelLoopBody {
+ public:
+  PolarGradient(const Mat& src, float scale, Mat* mag, Mat* ori) : src_(src),
+      scale_(scale), mag_(mag), ori_(ori) {}
+
+  void operator()(const Range& range) const {
+    const int rows = src_.rows;
+    const int cols = src_.cols;
+    const float k = 0.5f * scale_;
+    const float to_radian = static_cast<float>(CV_PI / 180);
+
+    for (int y = range.start; y < range.end; ++y) {
+      const T* up = src_.ptr<T>(max(y - 1, 0));
+      const T* cur = src_.ptr<T>(y);
+      const T* down = src_.ptr<T>(min(y + 1, rows - 1));
+      float* m = mag_->ptr<float>(y);
+      float* o = ori_->ptr<float>(y);
+      for (int x = 0; x < cols; ++x) {
+        float dx = (static_cast<float>(cur[min(x + 1, cols - 1)])
+            - cur[max(x - 1, 0)]) * k;
+        float dy = (static_cast<float>(down[x]) - up[x]) * k;
+        m[x] = sqrt(dx * dx + dy * dy);
+        o[x] = fastAtan2(dy, dx) * to_radian;
+      }
+    }
+  }
+
+ private:
+  const Mat& src_;
+  float scale_;
+  Mat* mag_;
+  Mat* ori_;
+};
+
+// A keypoint with the gradient of its level, in octave coordinates
+struct DescriptorSample {
+  const Mat* mag;
+  const Mat* ori;
+  float x;
+  float y;
+  float sigma;
+  int n_angles;
+  float angles[kMaxOrientations];
+};
+
+// Find the peaks of the smoothed histogram of gradient orientations in a
+// Gaussian window around the sample
+void AssignOrientations(DescriptorSample* sample) {
+  const Mat& mag = *sample->mag;
+  const Mat& ori = *sample->ori;
+  const float sigma = kOrientationSigma * sample->sigma;
+  const int radius = cvRound(3 * sigma);
+  const int xc = cvRound(sample->x);
+  const int yc = cvRound(sample->y);
+  const float weight_scale = -1 / (2 * sigma * sigma);
+  const float bins_per_radian = kOrientationBins / kTwoPi;
+
+  float hist[kOrientationBins] = {0};
+  for (int y = max(yc - radius, 0); y <= min(yc + radius, mag.rows - 1); ++y) {
+    const float* m = mag.ptr<float>(y);
+    const float* o = ori.ptr<float>(y);
+    const float dy = y - sample->y;
+    for (int x = max(xc - radius, 0); x <= min(xc + radius, mag.cols - 1);
+        ++x) {
+      const float dx = x - sample->x;
+      int bin = cvRound(o[x] * bins_per_radian);
+      if (bin >= kOrientationBins) bin -= kOrientationBins;
+      hist[bin] += exp((dx * dx + dy * dy) * weight_scale) * m[x];
+    }
+  }
+
+  // Smooth circularly by repeated box filtering
+  for (int pass = 0; pass < 6; ++pass) {
+    float first = hist[0];
+    float prev = hist[kOrientationBins - 1];
+    for (int i = 0; i < kOrientationBins; ++i) {
+      float next = (i + 1 < kOrientationBins) ? hist[i + 1] : first;
+      float cur = hist[i];
+      hist[i] = (prev + cur + next) / 3;
+      prev = cur;
+    }
+  }
+
+  float max_value = *std::max_element(hist, hist + kOrientationBins);
+  float peak_value[kMaxOrientations];
+  sample->n_angles = 0;
+  for (int i = 0; i < kOrientationBins; ++i) {
+    float left = hist[(i + kOrientationBins - 1) % kOrientationBins];
+    float right = hist[(i + 1) % kOrientationBins];
+    float h = hist[i];
+    if (h <= left || h <= right || h < kOrientationPeakRatio * max_value) {
+      continue;
+    }
+
+    // Quadratic interpolation of the peak, then keep the strongest ones
+    float offset = 0.5f * (left - right) / (left - 2 * h + right);
+    float angle = (i + offset) / bins_per_radian;
+    if (angle < 0) angle += kTwoPi;
+    if (angle >= kTwoPi) angle -= kTwoPi;
+
+    int k = sample->n_angles;
+    if (k == kMaxOrientations) {
+      if (h <= peak_value[k - 1]) continue;
+      --k;
+    } else {
+      ++sample->n_angles;
+    }
+    for (; k > 0 && peak_value[k - 1] < h; --k) {
+      peak_value[k] = peak_value[k - 1];
+      sample->angles[k] = sample->angles[k - 1];
+    }
+    peak_value[k] = h;
+    sample->angles[k] = angle;
+  }
+}
+
+// 4 x 4 x 8 histogram of the gradients in a window rotated by angle, with
+// trilinear interpolation between cells and orientation bins, normalized,
+// clamped and normalized again
+void Describe(const DescriptorSample& sample, float angle, float* desc) {
+  const int d = kDescriptorWidth;
+  const int n = kDescriptorBins;
+  const Mat& mag = *sample.mag;
+  const Mat& ori = *sample.ori;
+  const float cell = kDescriptorMagnification * sample.sigma;
+  const int radius = min(cvRound(cell * sqrt(2.0f) * (d + 1) * 0.5f),
+      cvRound(sqrt(static_cast<float>(mag.rows * mag.rows
+      + mag.cols * mag.cols))));
+  const float cos_t = cos(angle) / cell;
+  const float sin_t = sin(angle) / cell;
+  const float bins_per_radian = n / kTwoPi;
+  const float weight_scale = -1 / (0.5f * d * d);
+  const int xc = cvRound(sample.x);
+  const int yc = cvRound(sample.y);
+
+  // Cells and bins are padded by one on each side to skip bound checks
+  float hist[(kDescriptorWidth + 2) * (kDescriptorWidth + 2)
+      * (kDescriptorBins + 2)] = {0};
+  for (int y = max(yc - radius, 0); y <= min(yc + radius, mag.rows - 1); ++y) {
+    const float* m = mag.ptr<float>(y);
+    const float* o = ori.ptr<float>(y);
+    const float dy = y - sample.y;
+    for (int x = max(xc - radius, 0); x <= min(xc + radius, mag.cols - 1);
+        ++x) {
+      const float dx = x - sample.x;
+      // Offset in cells along the rotated axes
+      float c_rot = dx * cos_t + dy * sin_t;
+      float r_rot = -dx * sin_t + dy * cos_t;
+      float rbin = r_rot + d / 2 - 0.5f;
+      float cbin = c_rot + d / 2 - 0.5f;
+      if (rbin <= -1 || rbin >= d || cbin <= -1 || cbin >= d) {
+        continue;
+      }
+
+      float theta = o[x] - angle;
+      if (theta < 0) theta += kTwoPi;
+      if (theta >= kTwoPi) theta -= kTwoPi;
+      float obin = theta * bins_per_radian;
+      float v = m[x] * exp((c_rot * c_rot + r_rot * r_rot) * weight_scale);
+
+      int r0 = cvFloor(rbin);
+      int c0 = cvFloor(cbin);
+      int o0 = cvFloor(obin);
+      rbin -= r0;
+      cbin -= c0;
+      obin -= o0;
+      if (o0 >= n) o0 -= n;
+
+      float v_r1 = v * rbin, v_r0 = v - v_r1;
+      float v_rc11 = v_r1 * cbin, v_rc10 = v_r1 - v_rc11;
+      float v_rc01 = v_r0 * cbin, v_rc00 = v_r0 - v_rc01;
+      float v_rco111 = v_rc11 * obin, v_rco110 = v_rc11 - v_rco111;
+      float v_rco101 = v_rc10 * obin, v_rco100 = v_rc10 - v_rco101;
+      float v_rco011 = v_rc01 * obin, v_rco010 = v_rc01 - v_rco011;
+      float v_rco001 = v_rc00 * obin, v_rco000 = v_rc00 - v_rco001;
+
+      int idx = ((r0 + 1) * (d + 2) + c0 + 1) * (n + 2) + o0;
+      hist[idx] += v_rco000;
+      hist[idx + 1] += v_rco001;
+      hist[idx + (n + 2)] += v_rco010;
+      hist[idx + (n + 3)] += v_rco011;
+      hist[idx + (d + 2) * (n + 2)] += v_rco100;
+      hist[idx + (d + 2) * (n + 2) + 1] += v_rco101;
+      hist[idx + (d + 3) * (n + 2)] += v_rco110;
+      hist[idx + (d + 3) * (n + 2) + 1] += v_rco111;
+    }
+  }
+
+  // Fold the orientation padding back, since orientation is circular
+  for (int r = 0; r < d; ++r) {
+    for (int c = 0; c < d; ++c) {
+      int idx = ((r + 1) * (d + 2) + c + 1) * (n + 2);
+      hist[idx] += hist[idx + n];
+      hist[idx + 1] += hist[idx + n + 1];
+      for (int k = 0; k < n; ++k) {
+        desc[(r * d + c) * n + k] = hist[idx + k];
+      }
+    }
+  }
+
+  // Clamping large values reduces the influence of non-linear illumination
+  for (int pass = 0; pass < 2; ++pass) {
+    float norm = 0;
+    for (int k = 0; k < ScaleSpace::kDescriptorSize; ++k) {
+      norm += desc[k] * desc[k];
+    }
+    norm = 1 / max(sqrt(norm), FLT_EPSILON);
+    for (int k = 0; k < ScaleSpace::kDescriptorSize; ++k) {
+      desc[k] *= norm;
+      if (pass == 0) {
+        desc[k] = min(desc[k], kDescriptorClamp);
+      }
+    }
+  }
+}
+
+class OrientationBody : public ParallelLoopBody {
+ public:
+  explicit OrientationBody(vector<DescriptorSample>* samples)
+      : samples_(samples) {}
+
+  void operator()(const Range& range) const {
+    for (int i = range.start; i < range.end; ++i) {
+      AssignOrientations(&(*samples_)[i]);
+    }
+  }
+
+ private:
+  vector<DescriptorSample>* samples_;
+};
+
+// Describe the keypoints in range, which refer to their samples through
+// owner and to their angle through angle
+class DescriptorBody : public ParallelLoopBody {
+ public:
+  DescriptorBody(const vector<DescriptorSample>& samples,
+      const vector<int>& owner, const vector<float>& angle, Mat* descriptors)
+      : samples_(samples), owner_(owner), angle_(angle),
+      descriptors_(descriptors) {}
+
+  void operator()(const Range& range) const {
+    float desc[ScaleSpace::kDescriptorSize];
+    for (int i = range.start; i < range.end; ++i) {
+      if (descriptors_->type() == CV_32FC1) {
+        Describe(samples_[owner_[i]], angle_[i], descriptors_->ptr<float>(i));
+      } else {
+        Describe(samples_[owner_[i]], angle_[i], desc);
+        uchar* d = descriptors_->ptr<uchar>(i);
+        for (int k = 0; k < ScaleSpace::kDescriptorSize; ++k) {
+          d[k] = saturate_cast<uchar>(desc[k] * 512);
         }
       }
     }
   }
 
-  ReleaseDoG(dog);
+ private:
+  const vector<DescriptorSample>& samples_;
+  const vector<int>& owner_;
+  const vector<float>& angle_;
+  Mat* descriptors_;
+};
+
 }
 
-Mat** ScaleSpace::GenerateDoG() {
-  Mat** dog = new Mat*[O_];
+int ScaleSpace::EnsureGradient(int o, int s) {
+  const int index = (o - omin_) * (smax_ - smin_ + 1) + s - smin_;
+  if (grad_ready_[index]) {
+    return index;
+  }
+
+  EnsureLevels(o, s - smin_ + 1);
+  const Mat& level = *GetOctaveLevelPtr(o, s);
+  grad_mag_[index].create(level.size(), CV_32FC1);
+  grad_ori_[index].create(level.size(), CV_32FC1);
+  if (level.type() == CV_16UC1) {
+    RunBands(Range(0, level.rows), PolarGradient<ushort>(level,
+        1 / kFixedOne, &grad_mag_[index], &grad_ori_[index]));
+  } else {
+    RunBands(Range(0, level.rows), PolarGradient<float>(level, 1,
+        &grad_mag_[index], &grad_ori_[index]));
+  }
+
+  grad_ready_[index] = true;
+  return index;
+}
+
+void ScaleSpace::ComputeDescriptors(const vector<vector<Keypoint> >& keypoints,
+    vector<vector<Keypoint> >* oriented, Mat* descriptors, int type) {
+  CV_Assert(!input_.empty() && oriented != NULL && descriptors != NULL);
+  CV_Assert(static_cast<int>(keypoints.size()) == O_);
+  CV_Assert(type == CV_32FC1 || type == CV_8UC1);
+
+  // Gradients are made serially for the levels in use, each in parallel
+  vector<DescriptorSample> samples;
   for (int i = 0; i < O_; ++i) {
-    dog[i] = new Mat[smax_ - smin_];
+    for (size_t k = 0; k < keypoints[i].size(); ++k) {
+      const Keypoint& kp = keypoints[i][k];
+      int s = min(max(cvRound(kp.s), smin_ + 1), smax_ - 2);
+      int index = EnsureGradient(omin_ + i, s);
+
+      DescriptorSample sample;
+      sample.mag = &grad_mag_[index];
+      sample.ori = &grad_ori_[index];
+      sample.x = kp.x;
+      sample.y = kp.y;
+      sample.sigma = static_cast<float>(GetScaleFromIndex(kp.s));
+      sample.n_angles = 0;
+      samples.push_back(sample);
+    }
   }
+  RunBands(Range(0, static_cast<int>(samples.size())),
+      OrientationBody(&samples));
 
+  // One keypoint per orientation
+  oriented->assign(O_, vector<Keypoint>());
+  vector<int> owner;
+  vector<float> angle;
+  int n = 0;
   for (int i = 0; i < O_; ++i) {
-    for (int j = 0; j < smax_ - smin_; ++j) {
-      dog[i][j] = octave_[i][j + 1] - octave_[i][j];
+    for (size_t k = 0; k < keypoints[i].size(); ++k, ++n) {
+      for (int a = 0; a < samples[n].n_angles; ++a) {
+        Keypoint kp = keypoints[i][k];
+        kp.angle = samples[n].angles[a];
+        (*oriented)[i].push_back(kp);
+        owner.push_back(n);
+        angle.push_back(kp.angle);
+      }
     }
   }
 
-  return dog;
+  descriptors->create(static_cast<int>(owner.size()), kDescriptorSize, type);
+  RunBands(Range(0, static_cast<int>(owner.size())),
+      DescriptorBody(samples, owner, angle, descriptors));
 }
 
-void ScaleSpace::ReleaseDoG(Mat** dog) {
+class ScaleSpace::BatchQueue {
+ public:
+  explicit BatchQueue(int n) : next_(0), n_(n) {}
+
+  // Claim the index of the next image, false when all are taken
+  bool Next(int* index) {
+    *index = next_++;
+    return *index < n_;
+  }
+
+ private:
+  std::atomic<int> next_;
+  const int n_;
+};
+
+class ScaleSpace::BatchWorkers : public ParallelLoopBody {
+ public:
+  BatchWorkers(const ScaleSpace* prototype, const vector<Mat>* images,
+      BatchVisitor* visitor, BatchQueue* queue) : prototype_(prototype),
+      images_(images), visitor_(visitor), queue_(queue) {}
+
+  void operator()(const Range& range) const {
+    for (int w = range.start; w < range.end; ++w) {
+      prototype_->RunBatchWorker(images_, visitor_, queue_);
+    }
+  }
+
+ private:
+  const ScaleSpace* prototype_;
+  const vector<Mat>* images_;
+  BatchVisitor* visitor_;
+  BatchQueue* queue_;
+};
+
+double ScaleSpace::BuildBatch(const vector<Mat>& images,
+    BatchVisitor* visitor) const {
+  CV_Assert(visitor != NULL);
+  if (images.empty()) {
+    return 0;
+  }
+
+  // Bad input is reported here rather than inside a worker thread
+  for (size_t i = 0; i < images.size(); ++i) {
+    if (images[i].empty() || images[i].type() != CV_8UC1
+        || images[i].size() != images[0].size()) {
+      CV_Error(CV_StsBadArg, "images are empty, or differ in type or size");
+    }
+  }
+
+  const int64 start = getTickCount();
+
+  const int n = static_cast<int>(images.size());
+  // Workers never wait for each other, so those started late find the
+  // queue emptied by the others and return at once
+  const int n_workers = min(num_threads_, n);
+  BatchQueue queue(n);
+  BatchWorkers workers(this, &images, visitor, &queue);
+  if (n_workers <= 1) {
+    workers(Range(0, 1));
+  } else {
+    parallel_for_(Range(0, n_workers), workers, n_workers);
+  }
+
+  double seconds = (getTickCount() - start) / getTickFrequency();
+  return (seconds > 0) ? n / seconds : 0;
+}
+
+void ScaleSpace::RunBatchWorker(const vector<Mat>* images,
+    BatchVisitor* visitor, BatchQueue* queue) const {
+  ScaleSpace space(this);
+  space.Preallocate((*images)[0].size());
+
+  int i = 0;
+  while (queue->Next(&i)) {
+    space.Build((*images)[i]);
+    visitor->Visit(i, &space);
+  }
+}
+
+int ScaleSpace::TileHalo() const {
+  // Wrong values at a cut tile border spread inward by the radius of every
+  // blur they pass through, measured here in input pixels. The bilinear
+  // upsampling of omin_ < 0 clamps at the border and adds one more pixel.
+  double extent = (omin_ < 0) ? 1 : 0;
+  double halo = 0;
+  int sbest = min(smin_ + S_, smax_);
   for (int i = 0; i < O_; ++i) {
-    delete[] dog[i];
+    const double scale = pow(2.0, omin_ + i);
+    const GaussianFilter& base = (i == 0) ? base_filter_ : level_filter_[0];
+    extent += base.radius() * scale;
+
+    double next_base = extent;
+    for (int s = smin_ + 1; s <= smax_; ++s) {
+      extent += level_filter_[s - smin_].radius() * scale;
+      if (s == sbest) {
+        next_base = extent;
+      }
+    }
+
+    // Extrema compare 3x3 neighbors, and refinement moves a few pixels more
+    halo = max(halo, extent + (kMaxRefineSteps + 1) * scale);
+    extent = next_base;
   }
-  delete[] dog;
-  dog = NULL;
+
+  // Tiles starting on the grid of the last octave are decimated, and their
+  // octave sizes rounded, the same way as the whole image
+  return static_cast<int>(alignSize(cvCeil(halo), 1 << max(omin_ + O_, 0)));
 }
 
-void ScaleSpace::Upsample(const Mat& src, Mat* dst, int factor) {
-  CV_Assert(factor > 0);
+void ScaleSpace::DetectKeypointsTiled(TileReader* reader, int tile_size,
+    TileVisitor* visitor, double min_contrast, double edge_ratio) {
+  CV_Assert(reader != NULL && visitor != NULL && tile_size > 0);
+
+  const Size size = reader->size();
+  const int halo = TileHalo();
+  tile_size = static_cast<int>(alignSize(tile_size, 1 << max(omin_ + O_, 0)));
+
+  // Every padded tile fits in the first one, so all share its storage except
+  // the smaller tiles at the right and bottom
+  Size max_size(min(tile_size + 2 * halo, size.width),
+      min(tile_size + 2 * halo, size.height));
+  Preallocate(max_size);
+  Mat buffer(max_size, CV_8UC1);
+
+  vector<vector<Keypoint> > keypoints;
+  for (int y = 0; y < size.height; y += tile_size) {
+    for (int x = 0; x < size.width; x += tile_size) {
+      Rect tile(x, y, min(tile_size, size.width - x),
+          min(tile_size, size.height - y));
+      Rect padded(Point(max(x - halo, 0), max(y - halo, 0)),
+          Point(min(tile.br().x + halo, size.width),
+          min(tile.br().y + halo, size.height)));
+
+      Mat img = buffer(Rect(0, 0, padded.width, padded.height));
+      reader->Read(padded, &img);
+      CV_Assert(img.size() == padded.size() && img.type() == CV_8UC1);
 
-  resize(src, *dst, Size(0, 0), factor, factor, INTER_LINEAR);
+      Build(img);
+      DetectKeypoints(&keypoints, min_contrast, edge_ratio);
+
+      // Keep the keypoints owned by the tile, moved to image coordinates
+      for (int i = 0; i < O_; ++i) {
+        const float scale = static_cast<float>(pow(2.0, omin_ + i));
+        vector<Keypoint>& octave = keypoints[i];
+        size_t n = 0;
+        for (size_t k = 0; k < octave.size(); ++k) {
+          Keypoint kp = octave[k];
+          kp.pt.x += padded.x;
+          kp.pt.y += padded.y;
+          if (kp.pt.x < tile.x || kp.pt.x >= tile.x + tile.width
+              || kp.pt.y < tile.y || kp.pt.y >= tile.y + tile.height) {
+            continue;
+          }
+          kp.x += padded.x / scale;
+          kp.y += padded.y / scale;
+          octave[n++] = kp;
+        }
+        octave.resize(n);
+      }
+
+      visitor->Visit(this, padded, tile, keypoints);
+    }
+  }
 }
 
-void ScaleSpace::Downsample(const Mat& src, Mat* dst, int factor) {
-  CV_Assert(factor > 0);
+namespace {
+
+// Bilinear interpolation by a power of two factor with pixel centers at half
+// integers and clamped borders, as INTER_LINEAR. Each source row is
+// interpolated horizontally once into a cached float row of the band scratch,
+// and the factor output rows between two such rows are blended from them.
+template <typename T>
+class BilinearUpsampler {
+ public:
+  BilinearUpsampler(const Mat& src, Mat* dst, int factor) : src_(src),
+      dst_(dst), factor_(factor) {}
 
-  double ratio = 1.0 / factor;
-  resize(src, *dst, Size(0, 0), ratio, ratio, INTER_NEAREST);
+  // Two cached rows and the blend of fixed point rows
+  int scratch_size() const {
+    return 3 * dst_->cols;
+  }
+
+  void operator()(const Range& range, float* scratch) const {
+    const int cols = dst_->cols;
+    float* h0 = scratch;
+    float* h1 = scratch + cols;
+    int row0 = -1;
+    int row1 = -1;
+
+    for (int y = range.start; y < range.end; ++y) {
+      int y0 = 0;
+      float beta = 0;
+      Locate(y, src_.rows, &y0, &beta, factor_);
+
+      if (y0 != row0) {
+        if (y0 == row1) {
+          std::swap(h0, h1);
+          std::swap(row0, row1);
+        } else {
+          InterpolateRow(src_.ptr<T>(y0), h0);
+          row0 = y0;
+        }
+      }
+
+      T* d = dst_->ptr<T>(y);
+      if (beta == 0) {
+        StoreRow(h0, cols, d);
+        continue;
+      }
+      if (y0 + 1 != row1) {
+        InterpolateRow(src_.ptr<T>(y0 + 1), h1);
+        row1 = y0 + 1;
+      }
+
+      // Blend in place when T is float, through the scratch row otherwise
+      float* blend = Target(d, scratch + 2 * cols);
+      const float b0 = 1 - beta;
+      const float b1 = beta;
+      int x = 0;
+#if defined(__SSE2__)
+      const __m128 vb0 = _mm_set1_ps(b0);
+      const __m128 vb1 = _mm_set1_ps(b1);
+      for (; x + 4 <= cols; x += 4) {
+        _mm_storeu_ps(blend + x, _mm_add_ps(
+            _mm_mul_ps(_mm_loadu_ps(h0 + x), vb0),
+            _mm_mul_ps(_mm_loadu_ps(h1 + x), vb1)));
+      }
+#endif
+      for (; x < cols; ++x) {
+        blend[x] = h0[x] * b0 + h1[x] * b1;
+      }
+      StoreRow(blend, cols, d);
+    }
+  }
+
+  // Source index and weight of the right neighbor for output index i, 0 at
+  // the borders
+  static void Locate(int i, int n, int* i0, float* alpha, int factor) {
+    float f = (i + 0.5f) / factor - 0.5f;
+    int k = cvFloor(f);
+    float a = f - k;
+    if (k < 0) {
+      k = 0;
+      a = 0;
+    }
+    if (k >= n - 1) {
+      k = n - 1;
+      a = 0;
+    }
+    *i0 = k;
+    *alpha = a;
+  }
+
+ private:
+  const Mat& src_;
+  Mat* dst_;
+  int factor_;
+
+  // The factor outputs from factor * k + factor / 2 on lie between s[k] and
+  // s[k + 1], the t-th with weight (t + 0.5) / factor on s[k + 1], which is
+  // exactly what Locate finds. The half intervals at the borders replicate
+  // the edge pixels.
+  void InterpolateRow(const T* s, float* h) const {
+    const int n = src_.cols;
+    const int f = factor_;
+    if (f == 1) {
+      std::copy(s, s + n, h);
+      return;
+    }
+
+    const int half = f / 2;
+    std::fill(h, h + half, static_cast<float>(s[0]));
+    std::fill(h + f * n - half, h + f * n, static_cast<float>(s[n - 1]));
+
+    int k = 0;
+    float* out = h + half;
+#if defined(__SSE2__)
+    if (f == 2) {
+      // Weights 1/4 and 3/4, interleaved into pairs of outputs
+      const __m128 w1 = _mm_set1_ps(0.25f);
+      const __m128 w3 = _mm_set1_ps(0.75f);
+      for (; k + 4 < n; k += 4) {
+        const __m128 s0 = Load4(s + k);
+        const __m128 s1 = Load4(s + k + 1);
+        const __m128 p = _mm_add_ps(_mm_mul_ps(s0, w3), _mm_mul_ps(s1, w1));
+        const __m128 q = _mm_add_ps(_mm_mul_ps(s0, w1), _mm_mul_ps(s1, w3));
+        _mm_storeu_ps(out + 2 * k, _mm_unpacklo_ps(p, q));
+        _mm_storeu_ps(out + 2 * k + 4, _mm_unpackhi_ps(p, q));
+      }
+    } else {
+      // factor is a multiple of 4, so each interval is whole vectors
+      const __m128 inv = _mm_set1_ps(1.0f / f);
+      const __m128 one = _mm_set1_ps(1.0f);
+      const __m128 step = _mm_set1_ps(4.0f);
+      for (; k + 1 < n; ++k) {
+        const __m128 s0 = _mm_set1_ps(static_cast<float>(s[k]));
+        const __m128 s1 = _mm_set1_ps(static_cast<float>(s[k + 1]));
+        __m128 t = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        float* o = out + f * k;
+        for (int i = 0; i < f; i += 4) {
+          const __m128 a = _mm_mul_ps(t, inv);
+          _mm_storeu_ps(o + i, _mm_add_ps(
+              _mm_mul_ps(s0, _mm_sub_ps(one, a)), _mm_mul_ps(s1, a)));
+          t = _mm_add_ps(t, step);
+        }
+      }
+    }
+#endif
+    const float inv = 1.0f / f;
+    for (; k + 1 < n; ++k) {
+      const float s0 = s[k];
+      const float s1 = s[k + 1];
+      float* o = out + f * k;
+      for (int i = 0; i < f; ++i) {
+        const float a = (i + 0.5f) * inv;
+        o[i] = s0 * (1 - a) + s1 * a;
+      }
+    }
+  }
+
+#if defined(__SSE2__)
+  static __m128 Load4(const float* s) {
+    return _mm_loadu_ps(s);
+  }
+
+  static __m128 Load4(const ushort* s) {
+    const __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(s));
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+  }
+#endif
+
+  static float* Target(float* d, float* /* scratch */) {
+    return d;
+  }
+
+  static float* Target(ushort* /* d */, float* scratch) {
+    return scratch;
+  }
+};
+
+// Decimate the rows and columns by factor
+template <typename T>
+class Decimator : public ParallelLoopBody {
+ public:
+  Decimator(const Mat& src, Mat* dst, int factor) : src_(src), dst_(dst),
+      factor_(factor) {}
+
+  void operator()(const Range& range) const {
+    for (int y = range.start; y < range.end; ++y) {
+      DecimateRow(src_.ptr<T>(y * factor_), factor_, dst_->cols,
+          dst_->ptr<T>(y));
+    }
+  }
+
+ private:
+  const Mat& src_;
+  Mat* dst_;
+  int factor_;
+};
+
+}
+
+void ScaleSpace::Upsample(const Mat& src, Mat* dst, int factor, int i) const {
+  CV_Assert(factor > 0 && (factor & (factor - 1)) == 0
+      && dst->data != src.data);
+  CV_Assert(src.type() == CV_32FC1 || src.type() == CV_16UC1);
+
+  dst->create(ScaleSize(src.size(), factor), src.type());
+
+  if (src.type() == CV_16UC1) {
+    RunBands(Range(0, dst->rows),
+        BilinearUpsampler<ushort>(src, dst, factor), i);
+  } else {
+    RunBands(Range(0, dst->rows),
+        BilinearUpsampler<float>(src, dst, factor), i);
+  }
+}
+
+void ScaleSpace::Downsample(const Mat& src, Mat* dst, int factor) const {
+  CV_Assert(factor > 0 && dst->data != src.data);
+  CV_Assert(src.type() == CV_32FC1 || src.type() == CV_16UC1);
+
+  // Pixel x of the result is pixel x * factor of src, as INTER_NEAREST
+  dst->create(ScaleSize(src.size(), 1.0 / factor), src.type());
+  if (src.type() == CV_16UC1) {
+    RunBands(Range(0, dst->rows), Decimator<ushort>(src, dst, factor));
+  } else {
+    RunBands(Range(0, dst->rows), Decimator<float>(src, dst, factor));
+  }
 }
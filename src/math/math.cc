@@ -7,13 +7,639 @@
 
 #include "math/math.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <climits>
 #include <cmath>
+#include <iterator>
+#include <queue>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 using namespace cv;
 
 const double MathUtils::kPI = 3.1415926;
 
+const size_t Random::kFillChunk;
+
+namespace {
+
+// S. Vigna, "An experimental exploration of Marsaglia's xorshift generators,
+// scrambled," ACM Transactions on Mathematical Software, vol. 42, 2016.
+uint64_t SplitMix64(uint64_t* x) {
+  uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+}
+
+Random::Random(const Random& other) : engine_(other.engine_),
+    buffered_(other.buffered_) {
+  if (other.mt_) {
+    mt_.reset(new std::mt19937(*other.mt_));
+  }
+  std::copy(other.state_, other.state_ + 4, state_);
+  std::copy(other.buffer_, other.buffer_ + 2, buffer_);
+}
+
+Random& Random::operator=(const Random& other) {
+  if (this != &other) {
+    engine_ = other.engine_;
+    if (other.mt_) {
+      mt_.reset(new std::mt19937(*other.mt_));
+    } else {
+      mt_.reset();
+    }
+    std::copy(other.state_, other.state_ + 4, state_);
+    std::copy(other.buffer_, other.buffer_ + 2, buffer_);
+    buffered_ = other.buffered_;
+  }
+  return *this;
+}
+
+uint64_t Random::UniqueSeed() {
+  static std::atomic<uint64_t> counter(0);
+  uint64_t x = static_cast<uint64_t>(
+      std::chrono::high_resolution_clock::now().time_since_epoch().count());
+  x ^= counter.fetch_add(1) * 0x9E3779B97F4A7C15ULL;
+  return SplitMix64(&x);
+}
+
+void Random::Seed(uint64_t seed, int stream) {
+  CV_Assert(stream >= 0);
+
+  buffered_ = 0;
+  switch (engine_) {
+    case kXoshiro256: {
+      uint64_t x = seed;
+      for (int i = 0; i < 4; ++i) {
+        state_[i] = SplitMix64(&x);
+      }
+      for (int i = 0; i < stream; ++i) {
+        JumpXoshiro();
+      }
+      break;
+    }
+    case kPcg64: {
+      // The stream selects the odd increment, the seed the starting state
+      state_[0] = state_[1] = 0;
+      state_[2] = (static_cast<uint64_t>(stream) << 1) | 1;
+      state_[3] = 0;
+      NextPcg(state_);
+      uint64_t x = seed;
+      uint64_t low = state_[0];
+      state_[0] += seed;
+      state_[1] += SplitMix64(&x) + (state_[0] < low);
+      NextPcg(state_);
+      break;
+    }
+    case kPhilox:
+      state_[0] = 0;
+      state_[1] = static_cast<uint64_t>(stream);
+      state_[2] = seed;
+      state_[3] = 0;
+      break;
+    default:
+      if (!mt_) {
+        mt_.reset(new std::mt19937);
+      }
+      if (stream == 0 && seed <= 0xFFFFFFFF) {
+        mt_->seed(static_cast<unsigned int>(seed));
+      } else {
+        std::seed_seq sequence = {static_cast<unsigned int>(seed),
+            static_cast<unsigned int>(seed >> 32),
+            static_cast<unsigned int>(stream)};
+        mt_->seed(sequence);
+      }
+      break;
+  }
+}
+
+void Random::JumpXoshiro() {
+  static const uint64_t kJump[] = {0x180EC6D33CFD0ABAULL,
+      0xD5A61266F0C9392CULL, 0xA9582618E03FC9AAULL, 0x39ABDC4529B1661CULL};
+
+  uint64_t s[4] = {0, 0, 0, 0};
+  for (int i = 0; i < 4; ++i) {
+    for (int b = 0; b < 64; ++b) {
+      if (kJump[i] & (1ULL << b)) {
+        for (int k = 0; k < 4; ++k) {
+          s[k] ^= state_[k];
+        }
+      }
+      NextXoshiro(state_);
+    }
+  }
+  std::copy(s, s + 4, state_);
+}
+
+void Random::PhiloxBlock(const uint64_t* state, uint64_t* out) {
+  const uint64_t kMul0 = 0xD2511F53;
+  const uint64_t kMul1 = 0xCD9E8D57;
+  const uint32_t kWeyl0 = 0x9E3779B9;
+  const uint32_t kWeyl1 = 0xBB67AE85;
+
+  uint32_t c0 = static_cast<uint32_t>(state[0]);
+  uint32_t c1 = static_cast<uint32_t>(state[0] >> 32);
+  uint32_t c2 = static_cast<uint32_t>(state[1]);
+  uint32_t c3 = static_cast<uint32_t>(state[1] >> 32);
+  uint32_t k0 = static_cast<uint32_t>(state[2]);
+  uint32_t k1 = static_cast<uint32_t>(state[2] >> 32);
+  for (int round = 0; round < 10; ++round) {
+    uint64_t p0 = kMul0 * c0;
+    uint64_t p1 = kMul1 * c2;
+    c0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+    c1 = static_cast<uint32_t>(p1);
+    c2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+    c3 = static_cast<uint32_t>(p0);
+    k0 += kWeyl0;
+    k1 += kWeyl1;
+  }
+  out[0] = c0 | (static_cast<uint64_t>(c1) << 32);
+  out[1] = c2 | (static_cast<uint64_t>(c3) << 32);
+}
+
+void Random::FillBits(uint64_t* out, size_t n) {
+  size_t i = 0;
+  switch (engine_) {
+    case kXoshiro256:
+    case kPcg64: {
+      uint64_t s[4];
+      std::copy(state_, state_ + 4, s);
+      if (engine_ == kXoshiro256) {
+        for (; i < n; ++i) {
+          out[i] = NextXoshiro(s);
+        }
+      } else {
+        for (; i < n; ++i) {
+          out[i] = NextPcg(s);
+        }
+      }
+      std::copy(s, s + 4, state_);
+      break;
+    }
+    case kPhilox:
+      for (; i < n && buffered_ > 0; ++i) {
+        out[i] = NextPhilox();
+      }
+      for (; i + 2 <= n; i += 2) {
+        PhiloxBlock(state_, out + i);
+        ++state_[0];
+      }
+      for (; i < n; ++i) {
+        out[i] = NextPhilox();
+      }
+      break;
+    default:
+      for (; i < n; ++i) {
+        uint64_t high = (*mt_)();
+        out[i] = (high << 32) | (*mt_)();
+      }
+      break;
+  }
+}
+
+void Random::UniformReal(const uint64_t* bits, size_t n, double min,
+    double range, double* out) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i exponent = _mm_set1_epi64x(0x3FF0000000000000LL);
+  const __m128d one = _mm_set1_pd(1.0);
+  const __m128d vmin = _mm_set1_pd(min);
+  const __m128d vrange = _mm_set1_pd(range);
+  for (; i + 2 <= n; i += 2) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bits + i));
+    v = _mm_or_si128(_mm_srli_epi64(v, 12), exponent);
+    __m128d unit = _mm_sub_pd(_mm_castsi128_pd(v), one);
+    _mm_storeu_pd(out + i, _mm_add_pd(vmin, _mm_mul_pd(unit, vrange)));
+  }
+#endif
+  for (; i < n; ++i) {
+    out[i] = min + Unit<double>(bits[i]) * range;
+  }
+}
+
+void Random::UniformReal(const uint64_t* bits, size_t n, float min,
+    float range, float* out) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i exponent = _mm_set1_epi32(0x3F800000);
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 vmin = _mm_set1_ps(min);
+  const __m128 vrange = _mm_set1_ps(range);
+  for (; i + 4 <= n; i += 4) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bits + i));
+    __m128i b = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(bits + i + 2));
+    // High halves of the four words
+    __m128i v = _mm_unpacklo_epi64(
+        _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 3, 1)),
+        _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 3, 1)));
+    v = _mm_or_si128(_mm_srli_epi32(v, 9), exponent);
+    __m128 unit = _mm_sub_ps(_mm_castsi128_ps(v), one);
+    _mm_storeu_ps(out + i, _mm_add_ps(vmin, _mm_mul_ps(unit, vrange)));
+  }
+#endif
+  for (; i < n; ++i) {
+    out[i] = min + Unit<float>(bits[i]) * range;
+  }
+}
+
+void RandomInt::Fill(int* out, size_t n) {
+  if (engine() == kMt19937) {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = distribution_(*mt());
+    }
+    return;
+  }
+
+  uint64_t bits[kFillChunk];
+  for (size_t i = 0; i < n; i += kFillChunk) {
+    size_t m = std::min(kFillChunk, n - i);
+    FillBits(bits, m);
+    for (size_t j = 0; j < m; ++j) {
+      out[i + j] = static_cast<int>(min_ + static_cast<int64_t>(
+          Bounded(bits[j])));
+    }
+  }
+}
+
+namespace {
+
+// Values per block of RunningStats::Push, small enough to stay in L1 cache
+// between the two passes
+const size_t kStatsBlock = 512;
+
+#if defined(__SSE2__)
+// Load four values as two pairs of doubles
+inline void Load4(const double* p, __m128d* lo, __m128d* hi) {
+  *lo = _mm_loadu_pd(p);
+  *hi = _mm_loadu_pd(p + 2);
+}
+
+inline void Load4(const float* p, __m128d* lo, __m128d* hi) {
+  __m128 v = _mm_loadu_ps(p);
+  *lo = _mm_cvtps_pd(v);
+  *hi = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+}
+
+inline void Load4(const int* p, __m128d* lo, __m128d* hi) {
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  *lo = _mm_cvtepi32_pd(v);
+  *hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+}
+
+inline double HorizontalSum(__m128d a, __m128d b) {
+  double s[2];
+  _mm_storeu_pd(s, _mm_add_pd(a, b));
+  return s[0] + s[1];
+}
+#endif
+
+// Sum and sum of squared deviations from the mean of n > 0 values, in two
+// passes
+template <typename T>
+void BlockMoments(const T* data, size_t n, double* sum, double* m2) {
+  size_t i = 0;
+  double s = 0;
+#if defined(__SSE2__)
+  __m128d s0 = _mm_setzero_pd();
+  __m128d s1 = _mm_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    __m128d lo, hi;
+    Load4(data + i, &lo, &hi);
+    s0 = _mm_add_pd(s0, lo);
+    s1 = _mm_add_pd(s1, hi);
+  }
+  s = HorizontalSum(s0, s1);
+#endif
+  for (; i < n; ++i) {
+    s += data[i];
+  }
+
+  const double mean = s / n;
+  double q = 0;
+  i = 0;
+#if defined(__SSE2__)
+  const __m128d vmean = _mm_set1_pd(mean);
+  __m128d q0 = _mm_setzero_pd();
+  __m128d q1 = _mm_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    __m128d lo, hi;
+    Load4(data + i, &lo, &hi);
+    lo = _mm_sub_pd(lo, vmean);
+    hi = _mm_sub_pd(hi, vmean);
+    q0 = _mm_add_pd(q0, _mm_mul_pd(lo, lo));
+    q1 = _mm_add_pd(q1, _mm_mul_pd(hi, hi));
+  }
+  q = HorizontalSum(q0, q1);
+#endif
+  for (; i < n; ++i) {
+    double d = data[i] - mean;
+    q += d * d;
+  }
+
+  *sum = s;
+  *m2 = q;
+}
+
+template <typename T>
+void PushBlocks(const T* data, size_t n, RunningStats* stats) {
+  for (size_t i = 0; i < n; i += kStatsBlock) {
+    size_t m = std::min(kStatsBlock, n - i);
+    double sum, m2;
+    BlockMoments(data + i, m, &sum, &m2);
+    stats->Merge(RunningStats(m, sum / m, m2));
+  }
+}
+
+}
+
+void RunningStats::Push(const float* data, size_t n) {
+  PushBlocks(data, n, this);
+}
+
+void RunningStats::Push(const double* data, size_t n) {
+  PushBlocks(data, n, this);
+}
+
+void RunningStats::Push(const int* data, size_t n) {
+  PushBlocks(data, n, this);
+}
+
+namespace {
+
+// Values whose bins are found before counting
+const size_t kHistogramBlock = 256;
+
+// Indices into the counts of Histogram, the same as Histogram::Bin
+template <typename T>
+void HistogramBins(const T* data, size_t n, double lower, double scale,
+    int bins, int* index) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128d vlower = _mm_set1_pd(lower);
+  const __m128d vscale = _mm_set1_pd(scale);
+  const __m128d vmin = _mm_set1_pd(-1);
+  const __m128d vmax = _mm_set1_pd(bins);
+  const __m128d one = _mm_set1_pd(1);
+  for (; i + 4 <= n; i += 4) {
+    __m128d lo, hi;
+    Load4(data + i, &lo, &hi);
+    lo = _mm_mul_pd(_mm_sub_pd(lo, vlower), vscale);
+    hi = _mm_mul_pd(_mm_sub_pd(hi, vlower), vscale);
+    // maxpd returns its second operand for NaN
+    lo = _mm_add_pd(_mm_min_pd(_mm_max_pd(lo, vmin), vmax), one);
+    hi = _mm_add_pd(_mm_min_pd(_mm_max_pd(hi, vmin), vmax), one);
+    __m128i v = _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo),
+        _mm_cvttpd_epi32(hi));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(index + i), v);
+  }
+#endif
+  for (; i < n; ++i) {
+    double t = (data[i] - lower) * scale;
+    t = (t >= -1) ? std::min(t, static_cast<double>(bins)) : -1;
+    index[i] = static_cast<int>(t + 1);
+  }
+}
+
+template <typename T>
+void CountBins(const T* data, size_t n, double lower, double scale, int bins,
+    vector<uint64_t>* counts) {
+  int index[kHistogramBlock];
+  uint64_t* c = &(*counts)[0];
+  for (size_t i = 0; i < n; i += kHistogramBlock) {
+    size_t m = std::min(kHistogramBlock, n - i);
+    HistogramBins(data + i, m, lower, scale, bins, index);
+    for (size_t j = 0; j < m; ++j) {
+      ++c[index[j]];
+    }
+  }
+}
+
+// Scale function k1 of the t-digest, which limits the clusters between
+// quantiles q and k1^-1(k1(q) + 1)
+inline double ScaleK1(double q, double compression) {
+  return compression / (2 * CV_PI) * asin(2 * q - 1);
+}
+
+inline double InverseScaleK1(double k, double compression) {
+  double angle = std::min(k * 2 * CV_PI / compression, CV_PI / 2);
+  return (sin(angle) + 1) / 2;
+}
+
+// Sort doubles by LSD radix sort on keys ordered like the values, 8 bits per
+// pass, skipping the bytes all keys share such as most exponent bits. It
+// has no data dependent branches, unlike comparison sorts of random values.
+void RadixSort(vector<double>* values) {
+  const size_t n = values->size();
+  vector<uint64_t> keys(n), swap(n);
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t bits;
+    memcpy(&bits, &(*values)[i], sizeof(bits));
+    keys[i] = (bits >> 63) ? ~bits : bits | 0x8000000000000000ULL;
+  }
+
+  size_t counts[8][256] = {{0}};
+  for (size_t i = 0; i < n; ++i) {
+    for (int b = 0; b < 8; ++b) {
+      ++counts[b][(keys[i] >> (8 * b)) & 0xFF];
+    }
+  }
+  for (int b = 0; b < 8; ++b) {
+    size_t* count = counts[b];
+    if (count[(keys[0] >> (8 * b)) & 0xFF] == n) {
+      continue;
+    }
+    size_t offset = 0;
+    for (int d = 0; d < 256; ++d) {
+      size_t c = count[d];
+      count[d] = offset;
+      offset += c;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      swap[count[(keys[i] >> (8 * b)) & 0xFF]++] = keys[i];
+    }
+    keys.swap(swap);
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t bits = (keys[i] >> 63) ? keys[i] & 0x7FFFFFFFFFFFFFFFULL
+        : ~keys[i];
+    memcpy(&(*values)[i], &bits, sizeof(bits));
+  }
+}
+
+}
+
+void Histogram::Push(const float* data, size_t n) {
+  CountBins(data, n, lower_, scale_, bins_, &counts_);
+  n_ += n;
+}
+
+void Histogram::Push(const double* data, size_t n) {
+  CountBins(data, n, lower_, scale_, bins_, &counts_);
+  n_ += n;
+}
+
+void Histogram::Push(const int* data, size_t n) {
+  CountBins(data, n, lower_, scale_, bins_, &counts_);
+  n_ += n;
+}
+
+void Histogram::Merge(const Histogram& other) {
+  CV_Assert(lower_ == other.lower_ && upper_ == other.upper_ &&
+      bins_ == other.bins_);
+
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    counts_[i] += other.counts_[i];
+  }
+  n_ += other.n_;
+}
+
+double Histogram::Quantile(double q) const {
+  CV_Assert(q >= 0 && q <= 1);
+
+  if (n_ == 0) {
+    return 0;
+  }
+
+  double rank = q * n_;
+  double below = static_cast<double>(counts_[0]);
+  if (rank <= below && counts_[0] > 0) {
+    return lower_;
+  }
+  for (int i = 1; i <= bins_; ++i) {
+    double count = static_cast<double>(counts_[i]);
+    if (count > 0 && rank <= below + count) {
+      return lower_ + (i - 1 + (rank - below) / count) / scale_;
+    }
+    below += count;
+  }
+  return upper_;
+}
+
+QuantileSketch::QuantileSketch(double compression)
+    : compression_(compression),
+      capacity_(static_cast<size_t>(10 * compression)),
+      n_(0),
+      min_(std::numeric_limits<double>::infinity()),
+      max_(-std::numeric_limits<double>::infinity()) {
+  CV_Assert(compression >= 10);
+
+  centroids_.reserve(static_cast<size_t>(compression));
+  buffer_.reserve(capacity_);
+}
+
+void QuantileSketch::Merge(const QuantileSketch& other) {
+  if (other.n_ == 0) {
+    return;
+  }
+  if (!other.buffer_.empty()) {
+    QuantileSketch compressed(other);
+    compressed.Compress();
+    Merge(compressed);
+    return;
+  }
+
+  n_ += other.n_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+  Absorb(other.centroids_);
+}
+
+void QuantileSketch::Compress() {
+  if (buffer_.empty()) {
+    return;
+  }
+
+  RadixSort(&buffer_);
+  vector<Centroid> values;
+  values.reserve(buffer_.size());
+  for (size_t i = 0; i < buffer_.size(); ++i) {
+    values.push_back(Centroid(buffer_[i], 1));
+  }
+  buffer_.clear();
+  Absorb(values);
+}
+
+void QuantileSketch::Absorb(const vector<Centroid>& incoming) {
+  vector<Centroid> sorted;
+  sorted.reserve(incoming.size() + centroids_.size());
+  std::merge(incoming.begin(), incoming.end(), centroids_.begin(),
+      centroids_.end(), back_inserter(sorted));
+  if (sorted.empty()) {
+    return;
+  }
+
+  double total = 0;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    total += sorted[i].weight;
+  }
+
+  // Merge neighbors while the cluster spans at most 1 in scale
+  centroids_.clear();
+  Centroid current = sorted[0];
+  double done = 0;
+  double limit = total * InverseScaleK1(ScaleK1(0, compression_) + 1,
+      compression_);
+  for (size_t i = 1; i < sorted.size(); ++i) {
+    const Centroid& c = sorted[i];
+    if (done + current.weight + c.weight <= limit) {
+      current.weight += c.weight;
+      current.mean += (c.mean - current.mean) * c.weight / current.weight;
+    } else {
+      centroids_.push_back(current);
+      done += current.weight;
+      limit = total * InverseScaleK1(ScaleK1(done / total, compression_) + 1,
+          compression_);
+      current = c;
+    }
+  }
+  centroids_.push_back(current);
+}
+
+double QuantileSketch::Quantile(double q) const {
+  CV_Assert(q >= 0 && q <= 1);
+
+  if (n_ == 0) {
+    return 0;
+  }
+  if (!buffer_.empty()) {
+    QuantileSketch compressed(*this);
+    compressed.Compress();
+    return compressed.Quantile(q);
+  }
+
+  // The weight of each cluster is spread around its mean, so ranks are
+  // interpolated between the means of neighbors, and towards min_ and max_
+  // at the ends
+  const vector<Centroid>& c = centroids_;
+  double rank = q * n_;
+  double center = c[0].weight / 2;
+  if (rank < center) {
+    return min_ + (c[0].mean - min_) * rank / center;
+  }
+  for (size_t i = 0; i + 1 < c.size(); ++i) {
+    double next = center + (c[i].weight + c[i + 1].weight) / 2;
+    if (rank < next) {
+      return c[i].mean + (c[i + 1].mean - c[i].mean) * (rank - center) /
+          (next - center);
+    }
+    center = next;
+  }
+  double half = c.back().weight / 2;
+  return c.back().mean + (max_ - c.back().mean) *
+      std::min((rank - center) / half, 1.0);
+}
+
 bool MathUtils::IsRectIntersected(Rect a, Rect b, Rect* intersect) {
   int x = std::max(a.x, b.x);
   int y = std::max(a.y, b.y);
@@ -27,38 +653,1016 @@ bool MathUtils::IsRectIntersected(Rect a, Rect b, Rect* intersect) {
   return width > 0;
 }
 
+namespace {
+
+// Rectangles crossing the sweep line, as a static balanced tree over all
+// rectangles sorted by top. Each node keeps the largest bottom among the
+// active rectangles below it, so subtrees ending above the query or starting
+// below it are skipped.
+class ActiveRects {
+ public:
+  explicit ActiveRects(const vector<Rect>& rects) : rects_(rects) {
+    int n = static_cast<int>(rects.size());
+    order_.resize(n);
+    for (int i = 0; i < n; ++i) {
+      order_[i] = i;
+    }
+    sort(order_.begin(), order_.end(), ByTop(rects));
+    leaf_.resize(n);
+    top_.resize(n);
+    for (int i = 0; i < n; ++i) {
+      leaf_[order_[i]] = i;
+      top_[i] = rects[order_[i]].y;
+    }
+    size_ = 1;
+    while (size_ < n) {
+      size_ *= 2;
+    }
+    bottom_.assign(2 * size_, INT_MIN);
+  }
+
+  void Insert(int i) {
+    Update(leaf_[i], rects_[i].y + rects_[i].height);
+  }
+
+  void Remove(int i) {
+    Update(leaf_[i], INT_MIN);
+  }
+
+  // Call visitor(j) for every active j overlapping [top, bottom) in y
+  template <typename Visitor>
+  void Query(int top, int bottom, Visitor* visitor) const {
+    Query(1, 0, size_, top, bottom, visitor);
+  }
+
+ private:
+  struct ByTop {
+    explicit ByTop(const vector<Rect>& rects) : rects(rects) {}
+    bool operator()(int a, int b) const {
+      return rects[a].y < rects[b].y || (rects[a].y == rects[b].y && a < b);
+    }
+    const vector<Rect>& rects;
+  };
+
+  const vector<Rect>& rects_;
+  vector<int> order_;
+  vector<int> leaf_;
+  vector<int> top_;
+  int size_;
+  vector<int> bottom_;
+
+  void Update(int pos, int bottom) {
+    int node = pos + size_;
+    bottom_[node] = bottom;
+    for (node /= 2; node >= 1; node /= 2) {
+      bottom_[node] = std::max(bottom_[2 * node], bottom_[2 * node + 1]);
+    }
+  }
+
+  template <typename Visitor>
+  void Query(int node, int lo, int hi, int top, int bottom,
+      Visitor* visitor) const {
+    if (bottom_[node] <= top || lo >= static_cast<int>(top_.size()) ||
+        top_[lo] >= bottom) {
+      return;
+    }
+    if (hi - lo == 1) {
+      (*visitor)(order_[lo]);
+      return;
+    }
+    int mid = (lo + hi) / 2;
+    Query(2 * node, lo, mid, top, bottom, visitor);
+    Query(2 * node + 1, mid, hi, top, bottom, visitor);
+  }
+};
+
+// Passes the pairs found for the rectangle entering the sweep line on to
+// the visitor if their IoU is high enough
+template <typename PairVisitor>
+class PairFilter {
+ public:
+  PairFilter(const vector<Rect>& rects, double min_iou, PairVisitor* visitor)
+      : rects_(rects), min_iou_(min_iou), visitor_(visitor), current_(0) {}
+
+  void set_current(int i) {
+    current_ = i;
+  }
+
+  void operator()(int j) {
+    const Rect& a = rects_[current_];
+    const Rect& b = rects_[j];
+    if (min_iou_ > 0) {
+      int64 w = std::min(a.x + a.width, b.x + b.width) - std::max(a.x, b.x);
+      int64 h = std::min(a.y + a.height, b.y + b.height) -
+          std::max(a.y, b.y);
+      int64 overlap = w * h;
+      int64 area = static_cast<int64>(a.width) * a.height +
+          static_cast<int64>(b.width) * b.height - overlap;
+      if (overlap < min_iou_ * area) {
+        return;
+      }
+    }
+    (*visitor_)(std::min(current_, j), std::max(current_, j));
+  }
+
+ private:
+  const vector<Rect>& rects_;
+  const double min_iou_;
+  PairVisitor* visitor_;
+  int current_;
+};
+
+class PairCollector {
+ public:
+  explicit PairCollector(vector<std::pair<int, int> >* pairs)
+      : pairs_(pairs) {}
+
+  void operator()(int i, int j) {
+    pairs_->push_back(std::make_pair(i, j));
+  }
+
+ private:
+  vector<std::pair<int, int> >* pairs_;
+};
+
+// Union-find with union by size and path halving, joining the sets of each
+// pair it is called with
+class DisjointSets {
+ public:
+  explicit DisjointSets(int n) : parent_(n), size_(n, 1) {
+    for (int i = 0; i < n; ++i) {
+      parent_[i] = i;
+    }
+  }
+
+  int Find(int i) {
+    while (parent_[i] != i) {
+      parent_[i] = parent_[parent_[i]];
+      i = parent_[i];
+    }
+    return i;
+  }
+
+  void operator()(int i, int j) {
+    i = Find(i);
+    j = Find(j);
+    if (i == j) {
+      return;
+    }
+    if (size_[i] < size_[j]) {
+      std::swap(i, j);
+    }
+    parent_[j] = i;
+    size_[i] += size_[j];
+  }
+
+ private:
+  vector<int> parent_;
+  vector<int> size_;
+};
+
+// Sweep along x and call visitor(i, j), i < j, for every pair of
+// rectangles sharing a positive area with IoU at least min_iou
+template <typename PairVisitor>
+void SweepRects(const vector<Rect>& rects, double min_iou,
+    PairVisitor* visitor) {
+  // Events are (x, kind * n + i), so that at the same x rectangles leave
+  // before others enter and those only touching are not reported. Empty
+  // rectangles never intersect and are left out.
+  const int n = static_cast<int>(rects.size());
+  const int kLeave = 0;
+  const int kEnter = 1;
+  CV_Assert(n < INT_MAX / 2);
+  vector<std::pair<int, int> > events;
+  events.reserve(2 * n);
+  for (int i = 0; i < n; ++i) {
+    if (rects[i].width > 0 && rects[i].height > 0) {
+      events.push_back(std::make_pair(rects[i].x, kEnter * n + i));
+      events.push_back(std::make_pair(rects[i].x + rects[i].width,
+          kLeave * n + i));
+    }
+  }
+  sort(events.begin(), events.end());
+
+  ActiveRects active(rects);
+  PairFilter<PairVisitor> filter(rects, min_iou, visitor);
+  for (size_t e = 0; e < events.size(); ++e) {
+    int i = events[e].second % n;
+    if (events[e].second / n == kLeave) {
+      active.Remove(i);
+    } else {
+      filter.set_current(i);
+      active.Query(rects[i].y, rects[i].y + rects[i].height, &filter);
+      active.Insert(i);
+    }
+  }
+}
+
+}
+
+void MathUtils::IntersectingRects(const vector<Rect>& rects, double min_iou,
+    vector<std::pair<int, int> >* pairs) {
+  CV_Assert(pairs != NULL);
+
+  pairs->clear();
+  PairCollector collector(pairs);
+  SweepRects(rects, min_iou, &collector);
+  sort(pairs->begin(), pairs->end());
+}
+
+int MathUtils::ClusterRects(const vector<Rect>& rects, double min_iou,
+    vector<Rect>* boxes, vector<int>* labels) {
+  CV_Assert(boxes != NULL);
+
+  int n = static_cast<int>(rects.size());
+  DisjointSets sets(n);
+  SweepRects(rects, min_iou, &sets);
+
+  vector<int> cluster(n, -1);
+  vector<int> local_labels;
+  if (labels == NULL) {
+    labels = &local_labels;
+  }
+  labels->resize(n);
+  boxes->clear();
+  for (int i = 0; i < n; ++i) {
+    int root = sets.Find(i);
+    if (cluster[root] < 0) {
+      cluster[root] = static_cast<int>(boxes->size());
+      boxes->push_back(rects[i]);
+    } else {
+      Rect& box = (*boxes)[cluster[root]];
+      box = MinRectBoundingBox(box, rects[i]);
+    }
+    (*labels)[i] = cluster[root];
+  }
+  return static_cast<int>(boxes->size());
+}
+
+namespace {
+
+// Uniform grid over the extent of a set of rectangles, with cells about the
+// size of an average rectangle so that each one covers few cells
+class RectGrid {
+ public:
+  explicit RectGrid(const vector<Rect>& rects) {
+    int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+    double side = 0;
+    for (size_t i = 0; i < rects.size(); ++i) {
+      x0 = std::min(x0, rects[i].x);
+      y0 = std::min(y0, rects[i].y);
+      x1 = std::max(x1, rects[i].x + rects[i].width);
+      y1 = std::max(y1, rects[i].y + rects[i].height);
+      side += std::max(rects[i].width, rects[i].height);
+    }
+    if (rects.empty()) {
+      x0 = y0 = x1 = y1 = 0;
+    }
+    x0_ = x0;
+    y0_ = y0;
+
+    // Grow the cells until there are at most 4 per rectangle
+    double width = x1 - x0 + 1;
+    double height = y1 - y0 + 1;
+    double max_cells = 4.0 * rects.size() + 1;
+    cell_ = std::max(side / std::max<size_t>(rects.size(), 1), 1.0);
+    while ((width / cell_ + 1) * (height / cell_ + 1) > max_cells) {
+      cell_ *= 2;
+    }
+    cols_ = static_cast<int>(width / cell_) + 1;
+    rows_ = static_cast<int>(height / cell_) + 1;
+  }
+
+  int size() const {
+    return rows_ * cols_;
+  }
+
+  // The cells covered by rect, inclusive
+  void Cells(const Rect& rect, int* cx0, int* cy0, int* cx1, int* cy1) const {
+    *cx0 = static_cast<int>((rect.x - x0_) / cell_);
+    *cy0 = static_cast<int>((rect.y - y0_) / cell_);
+    *cx1 = static_cast<int>((rect.x + rect.width - x0_) / cell_);
+    *cy1 = static_cast<int>((rect.y + rect.height - y0_) / cell_);
+  }
+
+  int Index(int cx, int cy) const {
+    return cy * cols_ + cx;
+  }
+
+ private:
+  int x0_;
+  int y0_;
+  double cell_;
+  int rows_;
+  int cols_;
+};
+
+// Kept rectangles bucketed by grid cell, in groups of 4 per cell, each group
+// holding the 4 left, top, right and bottom edges and then the 4 areas. The
+// room of every cell is reserved up front for all rectangles covering it,
+// and unused slots are inverted boxes, which overlap nothing.
+class KeptBoxes {
+ public:
+  static const int kGroup = 4;
+  static const int kGroupSize = 5 * kGroup;
+
+  KeptBoxes(const RectGrid& grid, const vector<Rect>& rects)
+      : offset_(grid.size() + 1, 0), count_(grid.size(), 0) {
+    for (size_t i = 0; i < rects.size(); ++i) {
+      int cx0, cy0, cx1, cy1;
+      grid.Cells(rects[i], &cx0, &cy0, &cx1, &cy1);
+      for (int cy = cy0; cy <= cy1; ++cy) {
+        for (int cx = cx0; cx <= cx1; ++cx) {
+          ++count_[grid.Index(cx, cy)];
+        }
+      }
+    }
+    for (int c = 0; c < grid.size(); ++c) {
+      int groups = (count_[c] + kGroup - 1) / kGroup;
+      offset_[c + 1] = offset_[c] + groups * kGroupSize;
+      count_[c] = 0;
+    }
+
+    const float kEmpty[kGroupSize] = {FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX,
+        FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX,
+        -FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX, 0, 0, 0, 0};
+    boxes_.resize(offset_.back());
+    for (size_t i = 0; i < boxes_.size(); i += kGroupSize) {
+      std::copy(kEmpty, kEmpty + kGroupSize, &boxes_[i]);
+    }
+  }
+
+  void Add(int cell, const Rect& rect) {
+    int slot = count_[cell] % kGroup;
+    float* group = &boxes_[offset_[cell] + count_[cell] / kGroup *
+        kGroupSize];
+    group[slot] = static_cast<float>(rect.x);
+    group[kGroup + slot] = static_cast<float>(rect.y);
+    group[2 * kGroup + slot] = static_cast<float>(rect.x + rect.width);
+    group[3 * kGroup + slot] = static_cast<float>(rect.y + rect.height);
+    group[4 * kGroup + slot] = static_cast<float>(rect.area());
+    ++count_[cell];
+  }
+
+  // Whether a box of cell has an IoU above threshold with rect. IoU > t is
+  // tested as inter * (1 + t) > t * (area_a + area_b), without division.
+  bool OverlapsAny(int cell, const Rect& rect, float threshold) const {
+    const float x0 = static_cast<float>(rect.x);
+    const float y0 = static_cast<float>(rect.y);
+    const float x1 = static_cast<float>(rect.x + rect.width);
+    const float y1 = static_cast<float>(rect.y + rect.height);
+    const float area = static_cast<float>(rect.area());
+    const float scale = 1 + threshold;
+    const int groups = (count_[cell] + kGroup - 1) / kGroup;
+    const float* group = boxes_.empty() ? NULL : &boxes_[offset_[cell]];
+    const float* end = group + groups * kGroupSize;
+
+#if defined(__SSE2__)
+    const __m128 vx0 = _mm_set1_ps(x0);
+    const __m128 vy0 = _mm_set1_ps(y0);
+    const __m128 vx1 = _mm_set1_ps(x1);
+    const __m128 vy1 = _mm_set1_ps(y1);
+    const __m128 varea = _mm_set1_ps(area);
+    const __m128 vthreshold = _mm_set1_ps(threshold);
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 zero = _mm_setzero_ps();
+    for (; group != end; group += kGroupSize) {
+      __m128 w = _mm_sub_ps(_mm_min_ps(vx1, _mm_loadu_ps(group + 2 * kGroup)),
+          _mm_max_ps(vx0, _mm_loadu_ps(group)));
+      __m128 h = _mm_sub_ps(_mm_min_ps(vy1, _mm_loadu_ps(group + 3 * kGroup)),
+          _mm_max_ps(vy0, _mm_loadu_ps(group + kGroup)));
+      __m128 inter = _mm_mul_ps(_mm_max_ps(w, zero), _mm_max_ps(h, zero));
+      __m128 sum = _mm_add_ps(varea, _mm_loadu_ps(group + 4 * kGroup));
+      __m128 over = _mm_cmpgt_ps(_mm_mul_ps(inter, vscale),
+          _mm_mul_ps(vthreshold, sum));
+      if (_mm_movemask_ps(over) != 0) {
+        return true;
+      }
+    }
+#else
+    for (; group != end; group += kGroupSize) {
+      for (int i = 0; i < kGroup; ++i) {
+        float w = std::min(x1, group[2 * kGroup + i]) -
+            std::max(x0, group[i]);
+        float h = std::min(y1, group[3 * kGroup + i]) -
+            std::max(y0, group[kGroup + i]);
+        float inter = std::max(w, 0.0f) * std::max(h, 0.0f);
+        if (inter * scale > threshold * (area + group[4 * kGroup + i])) {
+          return true;
+        }
+      }
+    }
+#endif
+    return false;
+  }
+
+ private:
+  vector<float> boxes_;
+  // Start of the groups of each cell in boxes_
+  vector<int> offset_;
+  // Boxes added to each cell
+  vector<int> count_;
+};
+
+double RectIoU(const Rect& a, const Rect& b) {
+  int64 w = std::min(a.x + a.width, b.x + b.width) - std::max(a.x, b.x);
+  int64 h = std::min(a.y + a.height, b.y + b.height) - std::max(a.y, b.y);
+  if (w <= 0 || h <= 0) {
+    return 0;
+  }
+  int64 inter = w * h;
+  return static_cast<double>(inter) / (static_cast<int64>(a.area()) +
+      static_cast<int64>(b.area()) - inter);
+}
+
+}
+
+void MathUtils::NonMaxSuppression(const vector<Rect>& rects,
+    const vector<float>& scores, double iou_threshold, vector<int>* keep) {
+  CV_Assert(keep != NULL && rects.size() == scores.size());
+
+  // Decreasing score, ties by index, sorted by value rather than through the
+  // scores
+  int n = static_cast<int>(rects.size());
+  vector<std::pair<float, int> > order(n);
+  for (int i = 0; i < n; ++i) {
+    order[i] = std::make_pair(-scores[i], i);
+  }
+  sort(order.begin(), order.end());
+
+  RectGrid grid(rects);
+  KeptBoxes kept(grid, rects);
+  const float threshold = static_cast<float>(iou_threshold);
+  keep->clear();
+  for (int k = 0; k < n; ++k) {
+    const Rect& rect = rects[order[k].second];
+    int cx0, cy0, cx1, cy1;
+    grid.Cells(rect, &cx0, &cy0, &cx1, &cy1);
+
+    bool suppressed = false;
+    for (int cy = cy0; cy <= cy1 && !suppressed; ++cy) {
+      for (int cx = cx0; cx <= cx1 && !suppressed; ++cx) {
+        suppressed = kept.OverlapsAny(grid.Index(cx, cy), rect, threshold);
+      }
+    }
+    if (suppressed) {
+      continue;
+    }
+
+    keep->push_back(order[k].second);
+    for (int cy = cy0; cy <= cy1; ++cy) {
+      for (int cx = cx0; cx <= cx1; ++cx) {
+        kept.Add(grid.Index(cx, cy), rect);
+      }
+    }
+  }
+}
+
+void MathUtils::SoftNonMaxSuppression(const vector<Rect>& rects,
+    const vector<float>& scores, SoftNmsDecay decay, double param,
+    float min_score, vector<int>* keep, vector<float>* kept_scores) {
+  CV_Assert(keep != NULL && rects.size() == scores.size());
+  CV_Assert(decay == kLinearDecay || param > 0);
+
+  int n = static_cast<int>(rects.size());
+  RectGrid grid(rects);
+  vector<vector<int> > cells(grid.size());
+  vector<float> score(scores);
+  // 0 pending, 1 kept or dropped, or the index + 2 of the kept rectangle it
+  // was last compared with
+  vector<int> state(n, 0);
+
+  // Pending rectangles by decreasing score. An entry is stale if the score
+  // has decayed since it was pushed.
+  typedef std::pair<float, int> Entry;
+  std::priority_queue<Entry> queue;
+  for (int i = 0; i < n; ++i) {
+    if (score[i] < min_score) {
+      state[i] = 1;
+      continue;
+    }
+    queue.push(Entry(score[i], -i));
+    int cx0, cy0, cx1, cy1;
+    grid.Cells(rects[i], &cx0, &cy0, &cx1, &cy1);
+    for (int cy = cy0; cy <= cy1; ++cy) {
+      for (int cx = cx0; cx <= cx1; ++cx) {
+        cells[grid.Index(cx, cy)].push_back(i);
+      }
+    }
+  }
+
+  keep->clear();
+  if (kept_scores != NULL) {
+    kept_scores->clear();
+  }
+  while (!queue.empty()) {
+    Entry top = queue.top();
+    queue.pop();
+    int i = -top.second;
+    if (state[i] == 1 || top.first != score[i]) {
+      continue;
+    }
+    state[i] = 1;
+    keep->push_back(i);
+    if (kept_scores != NULL) {
+      kept_scores->push_back(score[i]);
+    }
+
+    int cx0, cy0, cx1, cy1;
+    grid.Cells(rects[i], &cx0, &cy0, &cx1, &cy1);
+    for (int cy = cy0; cy <= cy1; ++cy) {
+      for (int cx = cx0; cx <= cx1; ++cx) {
+        vector<int>& cell = cells[grid.Index(cx, cy)];
+        for (size_t k = 0; k < cell.size();) {
+          int j = cell[k];
+          if (state[j] == 1) {
+            // Drop kept and dropped rectangles from the cell for good
+            cell[k] = cell.back();
+            cell.pop_back();
+            continue;
+          }
+          ++k;
+          if (state[j] == i + 2) {
+            continue;
+          }
+          state[j] = i + 2;
+
+          double iou = RectIoU(rects[i], rects[j]);
+          if (iou <= 0) {
+            continue;
+          }
+          if (decay == kLinearDecay) {
+            if (iou <= param) {
+              continue;
+            }
+            score[j] *= static_cast<float>(1 - iou);
+          } else {
+            score[j] *= static_cast<float>(exp(-iou * iou / param));
+          }
+          if (score[j] < min_score) {
+            state[j] = 1;
+          } else {
+            queue.push(Entry(score[j], -j));
+          }
+        }
+      }
+    }
+  }
+}
+
+namespace {
+
+// dst[i] = a * x + b * y + c of each point, or its absolute value
+void ProjectPoints(const Point* points, int n, float a, float b, float c,
+    bool absolute, float* dst) {
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128 va = _mm_set1_ps(a);
+  const __m128 vb = _mm_set1_ps(b);
+  const __m128 vc = _mm_set1_ps(c);
+  const __m128 sign = _mm_castsi128_ps(_mm_set1_epi32(absolute ? 0x80000000
+      : 0));
+  for (; i + 4 <= n; i += 4) {
+    // x0 y0 x1 y1 and x2 y2 x3 y3 to x0 x1 y0 y1 and x2 x3 y2 y3
+    __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(points + i));
+    __m128i v1 = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(points + i + 2));
+    v0 = _mm_shuffle_epi32(v0, _MM_SHUFFLE(3, 1, 2, 0));
+    v1 = _mm_shuffle_epi32(v1, _MM_SHUFFLE(3, 1, 2, 0));
+    __m128 x = _mm_cvtepi32_ps(_mm_unpacklo_epi64(v0, v1));
+    __m128 y = _mm_cvtepi32_ps(_mm_unpackhi_epi64(v0, v1));
+    __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(va, x), _mm_mul_ps(vb, y)),
+        vc);
+    _mm_storeu_ps(dst + i, _mm_andnot_ps(sign, d));
+  }
+#endif
+  for (; i < n; ++i) {
+    float d = (a * points[i].x + b * points[i].y) + c;
+    dst[i] = absolute ? std::abs(d) : d;
+  }
+}
+
+struct ByRowThenColumn {
+  bool operator()(const Point& a, const Point& b) const {
+    return a.y < b.y || (a.y == b.y && a.x < b.x);
+  }
+};
+
+inline int64 Cross(const Point& o, const Point& a, const Point& b) {
+  return static_cast<int64>(a.x - o.x) * (b.y - o.y) -
+      static_cast<int64>(a.y - o.y) * (b.x - o.x);
+}
+
+// Projection of p - o on the direction w
+inline double Project(const Point2d& p, const Point2d& o, const Point2d& w) {
+  return (p.x - o.x) * w.x + (p.y - o.y) * w.y;
+}
+
+// Projection profiles of a point set at different angles
+class SkewProfile {
+ public:
+  explicit SkewProfile(const vector<Point>& points) : points_(points),
+      proj_(points.size()) {
+    double cx = 0, cy = 0;
+    for (size_t i = 0; i < points.size(); ++i) {
+      cx += points[i].x;
+      cy += points[i].y;
+    }
+    cx_ = cx / points.size();
+    cy_ = cy / points.size();
+    double radius = 0;
+    for (size_t i = 0; i < points.size(); ++i) {
+      double dx = points[i].x - cx_, dy = points[i].y - cy_;
+      radius = std::max(radius, dx * dx + dy * dy);
+    }
+    radius_ = sqrt(radius) + 1;
+    hist_.resize(2 * static_cast<int>(radius_) + 2);
+  }
+
+  // Distance from the center to the farthest point, plus 1
+  double radius() const {
+    return radius_;
+  }
+
+  // Sum of squared differences between adjacent bins of the profile across
+  // lines of direction angle
+  int64 Score(double angle) {
+    // The offset keeps every projection within [0, 2 * radius_)
+    float a = static_cast<float>(-sin(angle));
+    float b = static_cast<float>(cos(angle));
+    float c = static_cast<float>(radius_ - (a * cx_ + b * cy_));
+    int n = static_cast<int>(points_.size());
+    ProjectPoints(&points_[0], n, a, b, c, false, &proj_[0]);
+
+    std::fill(hist_.begin(), hist_.end(), 0);
+    const int last = static_cast<int>(hist_.size()) - 1;
+    for (int i = 0; i < n; ++i) {
+      int bin = static_cast<int>(proj_[i]);
+      ++hist_[std::min(std::max(bin, 0), last)];
+    }
+
+    int64 score = 0;
+    for (int k = 0; k < last; ++k) {
+      int64 d = hist_[k + 1] - hist_[k];
+      score += d * d;
+    }
+    return score;
+  }
+
+ private:
+  const vector<Point>& points_;
+  vector<float> proj_;
+  vector<int> hist_;
+  double cx_;
+  double cy_;
+  double radius_;
+};
+
+}
+
+void MathUtils::Point2LineDist(const vector<Point>& points, Vec3f line,
+    vector<float>* dists) {
+  CV_Assert(dists != NULL);
+
+  float scale = 1 / sqrt(line[0] * line[0] + line[1] * line[1]);
+  dists->resize(points.size());
+  if (!points.empty()) {
+    ProjectPoints(&points[0], static_cast<int>(points.size()),
+        line[0] * scale, line[1] * scale, line[2] * scale, true,
+        &(*dists)[0]);
+  }
+}
+
+void MathUtils::ConvexHull(const vector<Point>& points, vector<Point>* hull) {
+  CV_Assert(hull != NULL);
+
+  hull->clear();
+  if (points.empty()) {
+    return;
+  }
+
+  int top = INT_MAX, bottom = INT_MIN;
+  for (size_t i = 0; i < points.size(); ++i) {
+    top = std::min(top, points[i].y);
+    bottom = std::max(bottom, points[i].y);
+  }
+
+  // Sorted by row then column, only the ends of each row if rows are dense
+  vector<Point> sorted;
+  int64 rows = static_cast<int64>(bottom) - top + 1;
+  if (static_cast<int64>(points.size()) > 2 * rows) {
+    vector<int> left(static_cast<size_t>(rows), INT_MAX);
+    vector<int> right(static_cast<size_t>(rows), INT_MIN);
+    for (size_t i = 0; i < points.size(); ++i) {
+      int r = points[i].y - top;
+      left[r] = std::min(left[r], points[i].x);
+      right[r] = std::max(right[r], points[i].x);
+    }
+    for (int r = 0; r < rows; ++r) {
+      if (left[r] <= right[r]) {
+        sorted.push_back(Point(left[r], top + r));
+        if (right[r] != left[r]) {
+          sorted.push_back(Point(right[r], top + r));
+        }
+      }
+    }
+  } else {
+    sorted = points;
+    sort(sorted.begin(), sorted.end(), ByRowThenColumn());
+    sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+  }
+
+  int n = static_cast<int>(sorted.size());
+  if (n < 3) {
+    *hull = sorted;
+    return;
+  }
+
+  // One chain down the right side and one up the left side, popping the
+  // points which do not make a strict turn
+  vector<Point>& h = *hull;
+  h.resize(2 * n);
+  int k = 0;
+  for (int i = 0; i < n; ++i) {
+    while (k >= 2 && Cross(h[k - 2], h[k - 1], sorted[i]) <= 0) {
+      --k;
+    }
+    h[k++] = sorted[i];
+  }
+  for (int i = n - 2, lower = k + 1; i >= 0; --i) {
+    while (k >= lower && Cross(h[k - 2], h[k - 1], sorted[i]) <= 0) {
+      --k;
+    }
+    h[k++] = sorted[i];
+  }
+  h.resize(k - 1);
+}
+
+RotatedRect MathUtils::MinAreaRect(const vector<Point>& points) {
+  CV_Assert(!points.empty());
+
+  vector<Point> hull;
+  ConvexHull(points, &hull);
+  int n = static_cast<int>(hull.size());
+  if (n == 1) {
+    return RotatedRect(Point2f(static_cast<float>(hull[0].x),
+        static_cast<float>(hull[0].y)), Size2f(0, 0), 0);
+  }
+
+  vector<Point2d> p(n);
+  for (int i = 0; i < n; ++i) {
+    p[i] = Point2d(hull[i].x, hull[i].y);
+  }
+
+  // For each edge i, u runs along it and v across it. The calipers are the
+  // vertices with the largest and smallest projection on u and the largest
+  // distance along v, and only move forward as the edge does.
+  double best_area = DBL_MAX;
+  RotatedRect best;
+  int front = 0, back = 0, far = 0;
+  for (int i = 0; i < n; ++i) {
+    const Point2d& o = p[i];
+    Point2d d(p[(i + 1) % n].x - o.x, p[(i + 1) % n].y - o.y);
+    double length = sqrt(d.x * d.x + d.y * d.y);
+    Point2d u(d.x / length, d.y / length);
+    Point2d v(-u.y, u.x);
+
+    if (i == 0) {
+      for (int k = 1; k < n; ++k) {
+        if (Project(p[k], o, u) > Project(p[front], o, u)) {
+          front = k;
+        }
+        if (Project(p[k], o, u) < Project(p[back], o, u)) {
+          back = k;
+        }
+        if (std::abs(Project(p[k], o, v)) >
+            std::abs(Project(p[far], o, v))) {
+          far = k;
+        }
+      }
+    } else {
+      for (int step = 0; step < n && Project(p[(front + 1) % n], o, u) >=
+          Project(p[front], o, u); ++step) {
+        front = (front + 1) % n;
+      }
+      for (int step = 0; step < n && Project(p[(back + 1) % n], o, u) <=
+          Project(p[back], o, u); ++step) {
+        back = (back + 1) % n;
+      }
+      for (int step = 0; step < n &&
+          std::abs(Project(p[(far + 1) % n], o, v)) >=
+          std::abs(Project(p[far], o, v)); ++step) {
+        far = (far + 1) % n;
+      }
+    }
+
+    double max_u = Project(p[front], o, u);
+    double min_u = Project(p[back], o, u);
+    double across = Project(p[far], o, v);
+    double area = (max_u - min_u) * std::abs(across);
+    if (area < best_area) {
+      best_area = area;
+      double mid_u = (max_u + min_u) / 2;
+      best = RotatedRect(Point2f(
+          static_cast<float>(o.x + u.x * mid_u + v.x * across / 2),
+          static_cast<float>(o.y + u.y * mid_u + v.y * across / 2)),
+          Size2f(static_cast<float>(max_u - min_u),
+          static_cast<float>(std::abs(across))),
+          static_cast<float>(atan2(u.y, u.x) * 180 / CV_PI));
+    }
+  }
+  return best;
+}
+
+void MathUtils::PrincipalAxis(const vector<Point>& points, Point2f* center,
+    double* angle, Vec2d* variances) {
+  CV_Assert(!points.empty() && center != NULL && angle != NULL);
+
+  const Point origin = points[0];
+  int64 sx = 0, sy = 0, sxx = 0, sxy = 0, syy = 0;
+  for (size_t i = 0; i < points.size(); ++i) {
+    int64 x = points[i].x - origin.x;
+    int64 y = points[i].y - origin.y;
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+    syy += y * y;
+  }
+
+  double n = static_cast<double>(points.size());
+  double mx = sx / n, my = sy / n;
+  double cxx = sxx / n - mx * mx;
+  double cxy = sxy / n - mx * my;
+  double cyy = syy / n - my * my;
+
+  *center = Point2f(static_cast<float>(origin.x + mx),
+      static_cast<float>(origin.y + my));
+  *angle = 0.5 * atan2(2 * cxy, cxx - cyy);
+  if (variances != NULL) {
+    double mean = (cxx + cyy) / 2;
+    double spread = sqrt((cxx - cyy) * (cxx - cyy) / 4 + cxy * cxy);
+    *variances = Vec2d(mean + spread, std::max(mean - spread, 0.0));
+  }
+}
+
+double MathUtils::EstimateSkew(const vector<Point>& points, double max_angle,
+    double precision) {
+  CV_Assert(max_angle >= 0 && precision > 0);
+
+  if (points.size() < 2) {
+    return 0;
+  }
+
+  SkewProfile profile(points);
+  // Turning by 1 / radius moves the farthest points by about 1 bin
+  double step = std::max(precision, 1 / profile.radius());
+  int steps = static_cast<int>(ceil(max_angle / step));
+
+  double best = 0;
+  int64 best_score = profile.Score(0);
+  for (int k = -steps; k <= steps; ++k) {
+    double angle = std::max(-max_angle, std::min(max_angle, k * step));
+    int64 score = profile.Score(angle);
+    if (score > best_score) {
+      best_score = score;
+      best = angle;
+    }
+  }
+
+  while (step > precision) {
+    step /= 2;
+    double center = best;
+    for (int side = -1; side <= 1; side += 2) {
+      double angle = center + side * step;
+      if (std::abs(angle) > max_angle) {
+        continue;
+      }
+      int64 score = profile.Score(angle);
+      if (score > best_score) {
+        best_score = score;
+        best = angle;
+      }
+    }
+  }
+  return best;
+}
+
 void MathUtils::CalcHessian(const Mat& mat, Point pos, Mat* hessian) {
   CV_Assert(mat.type() == CV_32FC1 && mat.rows >= 3 && mat.cols >= 3);
 
-  static const int size = 3;
-  static const Mat xx_filter = (Mat_<float>(1, size)
-      << 1, -2, 1);
-  static const Mat yy_filter = (Mat_<float>(size, 1)
-      << 1, -2, 1);
-  static const Mat xy_filter = (Mat_<float>(size, size)
-      << 0.25f, 0, -0.25f, 0, 0, 0, -0.25f, 0, 0.25f);
+  float dxx, dyy, dxy;
+  CalcHessian(mat, pos, &dxx, &dyy, &dxy);
 
-  Point inner = pos;
-    // Shift the point to the inner neighbor if the point is located on the border
-  if (pos.x == 0) {
-    inner.x = 1;
-  } else if (pos.x == mat.cols - 1) {
-    inner.x = mat.cols - 2;
-  }
+  hessian->create(2, 2, CV_32FC1);
+  hessian->at<float>(0, 0) = dxx;
+  hessian->at<float>(1, 1) = dyy;
+  hessian->at<float>(0, 1) = dxy;
+  hessian->at<float>(1, 0) = dxy;
+}
+
+namespace {
+
+inline float EdgeResponse(float dxx, float dyy, float dxy) {
+  float tr = dxx + dyy;
+  float det = dxx * dyy - dxy * dxy;
+  return (det > 0) ? tr * tr / det : FLT_MAX;
+}
 
-  if (pos.y == 0) {
-    inner.y = 1;
-  } else if (pos.y == mat.rows - 1) {
-    inner.y = mat.rows - 2;
+// Hessian of the rows in range. The border rows and columns repeat those of
+// their inner neighbors, as CalcHessian shifts border points.
+class HessianBody : public ParallelLoopBody {
+ public:
+  HessianBody(const Mat& mat, Mat* dxx, Mat* dyy, Mat* dxy, Mat* edge)
+      : mat_(mat), dxx_(dxx), dyy_(dyy), dxy_(dxy), edge_(edge) {}
+
+  void operator()(const Range& range) const {
+    const int cols = mat_.cols;
+    for (int y = range.start; y < range.end; ++y) {
+      const int yi = std::min(std::max(y, 1), mat_.rows - 2);
+      const float* up = mat_.ptr<float>(yi - 1);
+      const float* cur = mat_.ptr<float>(yi);
+      const float* down = mat_.ptr<float>(yi + 1);
+      float* xx = dxx_->ptr<float>(y);
+      float* yy = dyy_->ptr<float>(y);
+      float* xy = dxy_->ptr<float>(y);
+      float* e = (edge_ != NULL) ? edge_->ptr<float>(y) : NULL;
+
+      int x = 1;
+#if defined(__SSE2__)
+      const __m128 quarter = _mm_set1_ps(0.25f);
+      const __m128 zero = _mm_setzero_ps();
+      const __m128 max_value = _mm_set1_ps(FLT_MAX);
+      for (; x + 4 <= cols - 1; x += 4) {
+        __m128 c = _mm_loadu_ps(cur + x);
+        __m128 c2 = _mm_add_ps(c, c);
+        __m128 vxx = _mm_add_ps(_mm_sub_ps(_mm_loadu_ps(cur + x - 1), c2),
+            _mm_loadu_ps(cur + x + 1));
+        __m128 vyy = _mm_add_ps(_mm_sub_ps(_mm_loadu_ps(up + x), c2),
+            _mm_loadu_ps(down + x));
+        __m128 vxy = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(_mm_sub_ps(
+            _mm_loadu_ps(up + x - 1), _mm_loadu_ps(up + x + 1)),
+            _mm_loadu_ps(down + x - 1)), _mm_loadu_ps(down + x + 1)),
+            quarter);
+        _mm_storeu_ps(xx + x, vxx);
+        _mm_storeu_ps(yy + x, vyy);
+        _mm_storeu_ps(xy + x, vxy);
+
+        if (e != NULL) {
+          __m128 tr = _mm_add_ps(vxx, vyy);
+          __m128 det = _mm_sub_ps(_mm_mul_ps(vxx, vyy), _mm_mul_ps(vxy, vxy));
+          __m128 positive = _mm_cmpgt_ps(det, zero);
+          __m128 ratio = _mm_div_ps(_mm_mul_ps(tr, tr), det);
+          _mm_storeu_ps(e + x, _mm_or_ps(_mm_and_ps(positive, ratio),
+              _mm_andnot_ps(positive, max_value)));
+        }
+      }
+#endif
+      for (; x < cols - 1; ++x) {
+        float c2 = cur[x] + cur[x];
+        xx[x] = (cur[x - 1] - c2) + cur[x + 1];
+        yy[x] = (up[x] - c2) + down[x];
+        xy[x] = (((up[x - 1] - up[x + 1]) - down[x - 1]) + down[x + 1])
+            * 0.25f;
+        if (e != NULL) {
+          e[x] = EdgeResponse(xx[x], yy[x], xy[x]);
+        }
+      }
+
+      xx[0] = xx[1];
+      yy[0] = yy[1];
+      xy[0] = xy[1];
+      xx[cols - 1] = xx[cols - 2];
+      yy[cols - 1] = yy[cols - 2];
+      xy[cols - 1] = xy[cols - 2];
+      if (e != NULL) {
+        e[0] = e[1];
+        e[cols - 1] = e[cols - 2];
+      }
+    }
   }
 
-  Mat roi = mat(Rect(inner.x - 1, inner.y, size, 1));
-  hessian->at<float>(0, 0) = static_cast<float>(roi.dot(xx_filter));
+ private:
+  const Mat& mat_;
+  Mat* dxx_;
+  Mat* dyy_;
+  Mat* dxy_;
+  Mat* edge_;
+};
 
-  roi = mat(Rect(inner.x, inner.y - 1, 1, size));
-  hessian->at<float>(1, 1) = static_cast<float>(roi.dot(yy_filter));
+}
+
+void MathUtils::CalcHessianMaps(const Mat& mat, Mat* dxx, Mat* dyy, Mat* dxy,
+    Mat* edge) {
+  CV_Assert(mat.type() == CV_32FC1 && mat.rows >= 3 && mat.cols >= 3);
+  CV_Assert(dxx != NULL && dyy != NULL && dxy != NULL);
+
+  dxx->create(mat.size(), CV_32FC1);
+  dyy->create(mat.size(), CV_32FC1);
+  dxy->create(mat.size(), CV_32FC1);
+  if (edge != NULL) {
+    edge->create(mat.size(), CV_32FC1);
+  }
 
-  roi = mat(Rect(inner.x - 1, inner.y - 1, size, size));
-  hessian->at<float>(0, 1) = static_cast<float>(roi.dot(xy_filter));
-  hessian->at<float>(1, 0) = hessian->at<float>(0, 1);
+  parallel_for_(Range(0, mat.rows), HessianBody(mat, dxx, dyy, dxy, edge));
 }
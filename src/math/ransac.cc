@@ -0,0 +1,778 @@
+// Copyright (c) 2010-2011, Tuji
+// All rights reserved.
+//
+// ${license}
+//
+// Author: LIU Yi
+
+#include "math/ransac.h"
+
+#include <cfloat>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+using namespace cv;
+
+namespace {
+
+// Hypotheses generated per round. It does not depend on the number of threads
+// so that neither does the result.
+const int kBatchSize = 64;
+// Points scored between two checks of the early exits
+const int kScoreBlock = 64;
+// Cost of generating a hypothesis in units of scoring one point, for SPRT
+const double kModelCost = 200;
+// Initial SPRT estimates of the inlier ratio of the best model and of the
+// fraction of points consistent with a bad model
+const double kInitialInlierRatio = 0.1;
+const double kInitialBadRatio = 0.01;
+
+// The points in the order they are scored, with the matched points in dx, dy
+struct PointSet {
+  vector<float> sx;
+  vector<float> sy;
+  vector<float> dx;
+  vector<float> dy;
+  // Index of each point in the input
+  vector<int> index;
+};
+
+// Coefficients of a model converted once for scoring, and the squared
+// threshold
+struct Scorer {
+  float m[9];
+  float t2;
+};
+
+#if defined(__SSE2__)
+inline int CountBits4(int mask) {
+  static const int kBits[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3,
+      4};
+  return kBits[mask];
+}
+#endif
+
+// Solve a * x = b in place by Gaussian elimination with partial pivoting
+//
+// @param a n x n row-major, destroyed
+// @param b OUTPUT, x
+// @return false if a is singular
+bool Solve(int n, double* a, double* b) {
+  double scale = 0;
+  for (int i = 0; i < n * n; ++i) {
+    scale = max(scale, fabs(a[i]));
+  }
+  const double eps = scale * 1e-12;
+
+  for (int k = 0; k < n; ++k) {
+    int pivot = k;
+    for (int i = k + 1; i < n; ++i) {
+      if (fabs(a[i * n + k]) > fabs(a[pivot * n + k])) {
+        pivot = i;
+      }
+    }
+    if (!(fabs(a[pivot * n + k]) > eps)) {
+      return false;
+    }
+    if (pivot != k) {
+      swap_ranges(a + k * n, a + k * n + n, a + pivot * n);
+      swap(b[k], b[pivot]);
+    }
+    for (int i = k + 1; i < n; ++i) {
+      double f = a[i * n + k] / a[k * n + k];
+      for (int j = k; j < n; ++j) {
+        a[i * n + j] -= f * a[k * n + j];
+      }
+      b[i] -= f * b[k];
+    }
+  }
+  for (int k = n - 1; k >= 0; --k) {
+    double sum = b[k];
+    for (int j = k + 1; j < n; ++j) {
+      sum -= a[k * n + j] * b[j];
+    }
+    b[k] = sum / a[k * n + k];
+  }
+  return true;
+}
+
+// Each model type provides the minimal sample size, the estimation from a
+// minimal sample, the inlier test of one point and of 4 points, which make
+// the same decisions, and the refinement on all inliers.
+
+struct LineModel {
+  static const int kSampleSize = 2;
+
+  static bool Estimate(const vector<Point2f>& src, const vector<Point2f>&,
+      const int* sample, double* model) {
+    const Point2f& p = src[sample[0]];
+    const Point2f& q = src[sample[1]];
+    double a = p.y - q.y;
+    double b = q.x - p.x;
+    double norm = sqrt(a * a + b * b);
+    if (!(norm > FLT_EPSILON)) {
+      return false;
+    }
+    model[0] = a / norm;
+    model[1] = b / norm;
+    model[2] = -(model[0] * p.x + model[1] * p.y);
+    return true;
+  }
+
+  static bool IsInlier(const PointSet& set, const Scorer& s, int i) {
+    float r = (s.m[0] * set.sx[i] + s.m[1] * set.sy[i]) + s.m[2];
+    return r * r <= s.t2;
+  }
+
+#if defined(__SSE2__)
+  static int Inliers4(const PointSet& set, const Scorer& s, int i) {
+    __m128 x = _mm_loadu_ps(&set.sx[i]);
+    __m128 y = _mm_loadu_ps(&set.sy[i]);
+    __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(s.m[0]), x),
+        _mm_mul_ps(_mm_set1_ps(s.m[1]), y)), _mm_set1_ps(s.m[2]));
+    return _mm_movemask_ps(_mm_cmple_ps(_mm_mul_ps(r, r),
+        _mm_set1_ps(s.t2)));
+  }
+#endif
+
+  // Total least squares through the centroid
+  static bool Refine(const vector<Point2f>& src, const vector<Point2f>&,
+      const vector<int>& inliers, double* model) {
+    double mx = 0, my = 0;
+    for (size_t i = 0; i < inliers.size(); ++i) {
+      mx += src[inliers[i]].x;
+      my += src[inliers[i]].y;
+    }
+    mx /= inliers.size();
+    my /= inliers.size();
+
+    double sxx = 0, sxy = 0, syy = 0;
+    for (size_t i = 0; i < inliers.size(); ++i) {
+      double x = src[inliers[i]].x - mx;
+      double y = src[inliers[i]].y - my;
+      sxx += x * x;
+      sxy += x * y;
+      syy += y * y;
+    }
+    if (!(sxx + syy > 0)) {
+      return false;
+    }
+
+    // The normal is perpendicular to the major axis
+    double theta = 0.5 * atan2(2 * sxy, sxx - syy);
+    model[0] = -sin(theta);
+    model[1] = cos(theta);
+    model[2] = -(model[0] * mx + model[1] * my);
+    return true;
+  }
+};
+
+struct AffineModel {
+  static const int kSampleSize = 3;
+
+  static bool Estimate(const vector<Point2f>& src,
+      const vector<Point2f>& dst, const int* sample, double* model) {
+    double a[9], ax[3], ay[3];
+    for (int i = 0; i < 3; ++i) {
+      a[i * 3] = src[sample[i]].x;
+      a[i * 3 + 1] = src[sample[i]].y;
+      a[i * 3 + 2] = 1;
+      ax[i] = dst[sample[i]].x;
+      ay[i] = dst[sample[i]].y;
+    }
+    double b[9];
+    copy(a, a + 9, b);
+    if (!Solve(3, a, ax) || !Solve(3, b, ay)) {
+      return false;
+    }
+    copy(ax, ax + 3, model);
+    copy(ay, ay + 3, model + 3);
+    return true;
+  }
+
+  static bool IsInlier(const PointSet& set, const Scorer& s, int i) {
+    float x = set.sx[i], y = set.sy[i];
+    float u = ((s.m[0] * x + s.m[1] * y) + s.m[2]) - set.dx[i];
+    float v = ((s.m[3] * x + s.m[4] * y) + s.m[5]) - set.dy[i];
+    return u * u + v * v <= s.t2;
+  }
+
+#if defined(__SSE2__)
+  static int Inliers4(const PointSet& set, const Scorer& s, int i) {
+    __m128 x = _mm_loadu_ps(&set.sx[i]);
+    __m128 y = _mm_loadu_ps(&set.sy[i]);
+    __m128 u = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(_mm_set1_ps(s.m[0]), x),
+        _mm_mul_ps(_mm_set1_ps(s.m[1]), y)), _mm_set1_ps(s.m[2])),
+        _mm_loadu_ps(&set.dx[i]));
+    __m128 v = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(_mm_set1_ps(s.m[3]), x),
+        _mm_mul_ps(_mm_set1_ps(s.m[4]), y)), _mm_set1_ps(s.m[5])),
+        _mm_loadu_ps(&set.dy[i]));
+    __m128 d = _mm_add_ps(_mm_mul_ps(u, u), _mm_mul_ps(v, v));
+    return _mm_movemask_ps(_mm_cmple_ps(d, _mm_set1_ps(s.t2)));
+  }
+#endif
+
+  // Least squares by the normal equations, shared by both rows
+  static bool Refine(const vector<Point2f>& src, const vector<Point2f>& dst,
+      const vector<int>& inliers, double* model) {
+    double ata[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+    double atx[3] = {0, 0, 0};
+    double aty[3] = {0, 0, 0};
+    for (size_t i = 0; i < inliers.size(); ++i) {
+      const double r[3] = {src[inliers[i]].x, src[inliers[i]].y, 1};
+      for (int j = 0; j < 3; ++j) {
+        for (int k = 0; k < 3; ++k) {
+          ata[j * 3 + k] += r[j] * r[k];
+        }
+        atx[j] += r[j] * dst[inliers[i]].x;
+        aty[j] += r[j] * dst[inliers[i]].y;
+      }
+    }
+    double b[9];
+    copy(ata, ata + 9, b);
+    if (!Solve(3, ata, atx) || !Solve(3, b, aty)) {
+      return false;
+    }
+    copy(atx, atx + 3, model);
+    copy(aty, aty + 3, model + 3);
+    return true;
+  }
+};
+
+struct HomographyModel {
+  static const int kSampleSize = 4;
+
+  // DLT with h33 = 1 on the sample normalized as in Refine, so that the
+  // system stays well conditioned for coordinates of large images
+  static bool Estimate(const vector<Point2f>& src,
+      const vector<Point2f>& dst, const int* sample, double* model) {
+    double t[2][3];
+    if (!Normalize(src, sample, 4, t[0]) || !Normalize(dst, sample, 4, t[1])) {
+      return false;
+    }
+
+    // b[8] = h33 once solved
+    double a[64], b[9];
+    for (int i = 0; i < 4; ++i) {
+      double x = (src[sample[i]].x - t[0][0]) * t[0][2];
+      double y = (src[sample[i]].y - t[0][1]) * t[0][2];
+      double u = (dst[sample[i]].x - t[1][0]) * t[1][2];
+      double v = (dst[sample[i]].y - t[1][1]) * t[1][2];
+      double* r0 = a + i * 16;
+      double* r1 = r0 + 8;
+      r0[0] = x; r0[1] = y; r0[2] = 1; r0[3] = 0; r0[4] = 0; r0[5] = 0;
+      r0[6] = -x * u; r0[7] = -y * u;
+      r1[0] = 0; r1[1] = 0; r1[2] = 0; r1[3] = x; r1[4] = y; r1[5] = 1;
+      r1[6] = -x * v; r1[7] = -y * v;
+      b[i * 2] = u;
+      b[i * 2 + 1] = v;
+    }
+    if (!Solve(8, a, b)) {
+      return false;
+    }
+    b[8] = 1;
+    return Denormalize(t, b, model);
+  }
+
+  // The transfer error is compared as |(H p)_xy - w q|^2 <= t^2 w^2 to avoid
+  // the division by w, points mapped behind the camera (w <= 0) are outliers
+  static bool IsInlier(const PointSet& set, const Scorer& s, int i) {
+    float x = set.sx[i], y = set.sy[i];
+    float w = (s.m[6] * x + s.m[7] * y) + s.m[8];
+    float u = ((s.m[0] * x + s.m[1] * y) + s.m[2]) - w * set.dx[i];
+    float v = ((s.m[3] * x + s.m[4] * y) + s.m[5]) - w * set.dy[i];
+    return w > 0 && u * u + v * v <= s.t2 * (w * w);
+  }
+
+#if defined(__SSE2__)
+  static int Inliers4(const PointSet& set, const Scorer& s, int i) {
+    __m128 x = _mm_loadu_ps(&set.sx[i]);
+    __m128 y = _mm_loadu_ps(&set.sy[i]);
+    __m128 w = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(s.m[6]), x),
+        _mm_mul_ps(_mm_set1_ps(s.m[7]), y)), _mm_set1_ps(s.m[8]));
+    __m128 u = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(_mm_set1_ps(s.m[0]), x),
+        _mm_mul_ps(_mm_set1_ps(s.m[1]), y)), _mm_set1_ps(s.m[2])),
+        _mm_mul_ps(w, _mm_loadu_ps(&set.dx[i])));
+    __m128 v = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(_mm_set1_ps(s.m[3]), x),
+        _mm_mul_ps(_mm_set1_ps(s.m[4]), y)), _mm_set1_ps(s.m[5])),
+        _mm_mul_ps(w, _mm_loadu_ps(&set.dy[i])));
+    __m128 d = _mm_add_ps(_mm_mul_ps(u, u), _mm_mul_ps(v, v));
+    __m128 in = _mm_and_ps(_mm_cmpgt_ps(w, _mm_setzero_ps()),
+        _mm_cmple_ps(d, _mm_mul_ps(_mm_set1_ps(s.t2), _mm_mul_ps(w, w))));
+    return _mm_movemask_ps(in);
+  }
+#endif
+
+  // Normalized DLT: both point sets are moved to the origin and scaled to a
+  // mean distance of sqrt(2), and h is the eigenvector of A^T A with the
+  // smallest eigenvalue
+  //
+  // R. I. Hartley, "In defense of the eight-point algorithm," IEEE
+  // Transactions on Pattern Analysis and Machine Intelligence, vol. 19, 1997,
+  // pp. 580-593.
+  static bool Refine(const vector<Point2f>& src, const vector<Point2f>& dst,
+      const vector<int>& inliers, double* model) {
+    const int n = static_cast<int>(inliers.size());
+    double t[2][3];
+    if (!Normalize(src, &inliers[0], n, t[0]) ||
+        !Normalize(dst, &inliers[0], n, t[1])) {
+      return false;
+    }
+
+    Mat ata = Mat::zeros(9, 9, CV_64FC1);
+    for (size_t i = 0; i < inliers.size(); ++i) {
+      double x = (src[inliers[i]].x - t[0][0]) * t[0][2];
+      double y = (src[inliers[i]].y - t[0][1]) * t[0][2];
+      double u = (dst[inliers[i]].x - t[1][0]) * t[1][2];
+      double v = (dst[inliers[i]].y - t[1][1]) * t[1][2];
+      const double r0[9] = {x, y, 1, 0, 0, 0, -x * u, -y * u, -u};
+      const double r1[9] = {0, 0, 0, x, y, 1, -x * v, -y * v, -v};
+      for (int j = 0; j < 9; ++j) {
+        double* row = ata.ptr<double>(j);
+        for (int k = j; k < 9; ++k) {
+          row[k] += r0[j] * r0[k] + r1[j] * r1[k];
+        }
+      }
+    }
+    completeSymm(ata);
+
+    Mat eigenvalues, eigenvectors;
+    eigen(ata, eigenvalues, eigenvectors);
+    return Denormalize(t, eigenvectors.ptr<double>(8), model);
+  }
+
+  // Mean and scale moving points[index[i]] to the origin at a mean distance
+  // of sqrt(2)
+  //
+  // @param t OUTPUT, mean x, mean y and scale
+  // @return false if the points coincide
+  static bool Normalize(const vector<Point2f>& points, const int* index,
+      int n, double t[3]) {
+    double mx = 0, my = 0;
+    for (int i = 0; i < n; ++i) {
+      mx += points[index[i]].x;
+      my += points[index[i]].y;
+    }
+    mx /= n;
+    my /= n;
+    double dist = 0;
+    for (int i = 0; i < n; ++i) {
+      double x = points[index[i]].x - mx;
+      double y = points[index[i]].y - my;
+      dist += sqrt(x * x + y * y);
+    }
+    if (!(dist > 0)) {
+      return false;
+    }
+    t[0] = mx;
+    t[1] = my;
+    t[2] = sqrt(2.0) * n / dist;
+    return true;
+  }
+
+  // H = T_dst^-1 * Hn * T_src, where T maps p to (p - mean) * scale, scaled
+  // to h33 = 1
+  //
+  // @param t the normalizations of src and dst
+  // @param hn the homography between the normalized points
+  static bool Denormalize(const double t[2][3], const double* hn,
+      double* model) {
+    double h[9];
+    for (int r = 0; r < 3; ++r) {
+      const double* row = hn + r * 3;
+      h[r * 3] = row[0] * t[0][2];
+      h[r * 3 + 1] = row[1] * t[0][2];
+      h[r * 3 + 2] = row[2] - (row[0] * t[0][0] + row[1] * t[0][1]) * t[0][2];
+    }
+    for (int c = 0; c < 3; ++c) {
+      h[c] = h[c] / t[1][2] + t[1][0] * h[6 + c];
+      h[3 + c] = h[3 + c] / t[1][2] + t[1][1] * h[6 + c];
+    }
+    if (!(fabs(h[8]) > DBL_EPSILON)) {
+      return false;
+    }
+    for (int i = 0; i < 9; ++i) {
+      model[i] = h[i] / h[8];
+    }
+    return true;
+  }
+};
+
+// SPRT decision parameters, fixed during a round
+struct Sprt {
+  bool enabled;
+  double log_inlier;   // log(delta / epsilon), added per consistent point
+  double log_outlier;  // log((1 - delta) / (1 - epsilon)), per other point
+  double log_threshold;
+  // Probability that a good model is not rejected
+  double acceptance;
+};
+
+// delta is the probability that a point is consistent with a bad model and
+// epsilon the one with a good model
+Sprt MakeSprt(bool enabled, double delta, double epsilon) {
+  Sprt sprt;
+  sprt.enabled = enabled && delta < epsilon && epsilon < 1;
+  sprt.acceptance = 1;
+  if (!sprt.enabled) {
+    return sprt;
+  }
+  sprt.log_inlier = log(delta / epsilon);
+  sprt.log_outlier = log((1 - delta) / (1 - epsilon));
+
+  // The optimal threshold A solves A = K + 1 + log(A), with K the cost of a
+  // hypothesis times the information gained per scored point
+  double c = (1 - delta) * log((1 - delta) / (1 - epsilon)) +
+      delta * log(delta / epsilon);
+  double k = kModelCost * c;
+  double a = k + 1;
+  for (int i = 0; i < 10; ++i) {
+    a = k + 1 + log(a);
+  }
+  sprt.log_threshold = log(a);
+  sprt.acceptance = 1 - 1 / a;
+  return sprt;
+}
+
+struct Hypothesis {
+  double model[9];
+  bool valid;
+  // Stopped early, so inliers is a lower bound among the scored points
+  bool stopped;
+  // Stopped by SPRT rather than by the bound on the best model
+  bool rejected;
+  int inliers;
+  int scored;
+};
+
+// Generates and scores the hypotheses first + [range) of a round
+template <typename Model>
+class HypothesisBody : public ParallelLoopBody {
+ public:
+  HypothesisBody(const vector<Point2f>& src, const vector<Point2f>& dst,
+      const PointSet& set, float t2, uint64_t seed, int first,
+      const vector<int>& subset, const vector<uchar>& last, int best,
+      const Sprt& sprt, vector<Hypothesis>* hypotheses) : src_(src),
+      dst_(dst), set_(set), t2_(t2), seed_(seed), first_(first),
+      subset_(subset), last_(last), best_(best), sprt_(sprt),
+      hypotheses_(hypotheses) {}
+
+  void operator()(const Range& range) const {
+    for (int k = range.start; k < range.end; ++k) {
+      Hypothesis& h = (*hypotheses_)[k];
+      int sample[Model::kSampleSize];
+      Draw(k, sample);
+      fill(h.model, h.model + 9, 0.0);
+      h.valid = Model::Estimate(src_, dst_, sample, h.model);
+      if (h.valid) {
+        Score(&h);
+      }
+    }
+  }
+
+ private:
+  const vector<Point2f>& src_;
+  const vector<Point2f>& dst_;
+  const PointSet& set_;
+  const float t2_;
+  const uint64_t seed_;
+  const int first_;
+  // Samples of hypothesis k are drawn from the first subset_[k] points, and
+  // include point subset_[k] - 1 if last_[k]
+  const vector<int>& subset_;
+  const vector<uchar>& last_;
+  const int best_;
+  const Sprt sprt_;
+  vector<Hypothesis>* hypotheses_;
+
+  // Distinct indices from the hypothesis' own random stream. Stream 0 is
+  // taken by the order of the points.
+  void Draw(int k, int* sample) const {
+    const int m = Model::kSampleSize;
+    int n = subset_[k];
+    int drawn = 0;
+    if (last_[k]) {
+      sample[drawn++] = --n;
+    }
+    RandomInt random(seed_, first_ + k + 1, kPhilox, 0, n - 1);
+    while (drawn < m) {
+      int i = random.Next();
+      if (find(sample, sample + drawn, i) == sample + drawn) {
+        sample[drawn++] = i;
+      }
+    }
+  }
+
+  void Score(Hypothesis* h) const {
+    Scorer s;
+    for (int i = 0; i < 9; ++i) {
+      s.m[i] = static_cast<float>(h->model[i]);
+    }
+    s.t2 = t2_;
+
+    const int n = static_cast<int>(set_.index.size());
+    int count = 0;
+    double log_lambda = 0;
+    h->stopped = h->rejected = false;
+    for (int begin = 0; begin < n; begin += kScoreBlock) {
+      int end = min(begin + kScoreBlock, n);
+      int i = begin;
+      int c = 0;
+#if defined(__SSE2__)
+      for (; i + 4 <= end; i += 4) {
+        c += CountBits4(Model::Inliers4(set_, s, i));
+      }
+#endif
+      for (; i < end; ++i) {
+        c += Model::IsInlier(set_, s, i);
+      }
+      count += c;
+
+      if (count + (n - end) <= best_) {
+        h->stopped = true;
+      } else if (sprt_.enabled) {
+        log_lambda += c * sprt_.log_inlier + (end - begin - c) *
+            sprt_.log_outlier;
+        if (log_lambda > sprt_.log_threshold) {
+          h->stopped = h->rejected = true;
+        }
+      }
+      if (h->stopped) {
+        h->scored = end;
+        break;
+      }
+    }
+    if (!h->stopped) {
+      h->scored = n;
+    }
+    h->inliers = count;
+  }
+};
+
+// Number of iterations to draw an all-inlier sample with probability
+// 1 - exp(log_failure)
+int MaxIterations(double log_failure, double inlier_ratio, int sample_size,
+    double acceptance, int max_iterations) {
+  double p = pow(inlier_ratio, sample_size) * acceptance;
+  if (p >= 1) {
+    return 1;
+  }
+  if (p <= 0) {
+    return max_iterations;
+  }
+  double k = log_failure / log(1 - p);
+  return (k < max_iterations) ? max(static_cast<int>(ceil(k)), 1)
+      : max_iterations;
+}
+
+}
+
+Ransac::Ransac() : threshold_(3), confidence_(0.99), max_iterations_(10000),
+    sampling_(kUniformSampling), sprt_(false),
+    num_stripes_(max(getNumThreads(), 1)), seed_(0), iterations_(0) {}
+
+int Ransac::FitLine(const vector<Point2f>& points, Vec3f* line,
+    vector<uchar>* inliers) {
+  CV_Assert(line != NULL);
+
+  double model[9];
+  int count = Fit<LineModel>(points, vector<Point2f>(), model, inliers);
+  if (count > 0) {
+    *line = Vec3f(static_cast<float>(model[0]), static_cast<float>(model[1]),
+        static_cast<float>(model[2]));
+  }
+  return count;
+}
+
+int Ransac::FitAffine(const vector<Point2f>& src, const vector<Point2f>& dst,
+    Mat* affine, vector<uchar>* inliers) {
+  CV_Assert(affine != NULL && src.size() == dst.size());
+
+  double model[9];
+  int count = Fit<AffineModel>(src, dst, model, inliers);
+  if (count > 0) {
+    Mat(2, 3, CV_64FC1, model).copyTo(*affine);
+  }
+  return count;
+}
+
+int Ransac::FitHomography(const vector<Point2f>& src,
+    const vector<Point2f>& dst, Mat* homography, vector<uchar>* inliers) {
+  CV_Assert(homography != NULL && src.size() == dst.size());
+
+  double model[9];
+  int count = Fit<HomographyModel>(src, dst, model, inliers);
+  if (count > 0) {
+    Mat(3, 3, CV_64FC1, model).copyTo(*homography);
+  }
+  return count;
+}
+
+template <typename Model>
+int Ransac::Fit(const vector<Point2f>& src, const vector<Point2f>& dst,
+    double* model, vector<uchar>* inliers) {
+  const int m = Model::kSampleSize;
+  const int n = static_cast<int>(src.size());
+  CV_Assert(n >= m);
+
+  // Score the points in random order, which SPRT relies on
+  PointSet set;
+  set.index.resize(n);
+  for (int i = 0; i < n; ++i) {
+    set.index[i] = i;
+  }
+  RandomInt shuffle(seed_, 0, kPhilox, 0, 1);
+  for (int i = n - 1; i > 0; --i) {
+    int j = static_cast<int>(((shuffle.NextBits() >> 32) * (i + 1)) >> 32);
+    swap(set.index[i], set.index[j]);
+  }
+  set.sx.resize(n);
+  set.sy.resize(n);
+  set.dx.resize(dst.empty() ? 0 : n);
+  set.dy.resize(dst.empty() ? 0 : n);
+  for (int i = 0; i < n; ++i) {
+    set.sx[i] = src[set.index[i]].x;
+    set.sy[i] = src[set.index[i]].y;
+    if (!dst.empty()) {
+      set.dx[i] = dst[set.index[i]].x;
+      set.dy[i] = dst[set.index[i]].y;
+    }
+  }
+
+  const float t2 = static_cast<float>(threshold_ * threshold_);
+  const double log_failure = log(1 - confidence_);
+
+  // PROSAC schedule: t_n is the expected number of samples among the first n
+  // points in max_iterations_ samples, t_prime_n the iteration to grow n
+  int prosac_n = m;
+  double t_n = max_iterations_;
+  for (int i = 0; i < m; ++i) {
+    t_n *= static_cast<double>(m - i) / (n - i);
+  }
+  double t_prime_n = 1;
+
+  double epsilon = kInitialInlierRatio;
+  double delta = kInitialBadRatio;
+  double delta_sum = 0;
+  int n_rejected = 0;
+  Sprt sprt = MakeSprt(sprt_, delta, epsilon);
+
+  int best = 0;
+  int limit = max_iterations_;
+  vector<Hypothesis> hypotheses(kBatchSize);
+  vector<int> subset(kBatchSize);
+  vector<uchar> last(kBatchSize);
+  iterations_ = 0;
+  while (iterations_ < limit) {
+    int batch = min(kBatchSize, limit - iterations_);
+    for (int k = 0; k < batch; ++k) {
+      int t = iterations_ + k + 1;
+      if (sampling_ == kProsacSampling && prosac_n < n && t > t_prime_n) {
+        double t_next = t_n * (prosac_n + 1) / (prosac_n + 1 - m);
+        t_prime_n += ceil(t_next - t_n);
+        t_n = t_next;
+        ++prosac_n;
+      }
+      if (sampling_ == kProsacSampling && prosac_n < n) {
+        subset[k] = prosac_n;
+        last[k] = (t_prime_n >= t);
+      } else {
+        subset[k] = n;
+        last[k] = 0;
+      }
+    }
+
+    HypothesisBody<Model> body(src, dst, set, t2, seed_, iterations_, subset,
+        last, best, sprt, &hypotheses);
+    if (num_stripes_ <= 1) {
+      body(Range(0, batch));
+    } else {
+      parallel_for_(Range(0, batch), body, num_stripes_);
+    }
+    iterations_ += batch;
+
+    // Take the results in order, so that they do not depend on the threads
+    bool updated = false;
+    for (int k = 0; k < batch; ++k) {
+      const Hypothesis& h = hypotheses[k];
+      if (!h.valid) {
+        continue;
+      }
+      if (h.rejected) {
+        delta_sum += static_cast<double>(h.inliers) / h.scored;
+        ++n_rejected;
+      } else if (!h.stopped && h.inliers > best) {
+        best = h.inliers;
+        copy(h.model, h.model + 9, model);
+        updated = true;
+      }
+    }
+    if (n_rejected > 0) {
+      delta = max(delta_sum / n_rejected, 1e-6);
+    }
+    if (updated) {
+      epsilon = static_cast<double>(best) / n;
+    }
+    sprt = MakeSprt(sprt_, delta, epsilon);
+    if (best > 0) {
+      limit = MaxIterations(log_failure, epsilon, m, sprt.acceptance,
+          max_iterations_);
+    }
+  }
+  if (best == 0) {
+    if (inliers != NULL) {
+      inliers->assign(n, 0);
+    }
+    return 0;
+  }
+
+  // Refine on the inliers, and keep the refined model unless it loses some
+  Scorer s;
+  s.t2 = t2;
+  vector<uchar> mask(n);
+  vector<int> best_inliers;
+  best_inliers.reserve(best);
+  for (int i = 0; i < 9; ++i) {
+    s.m[i] = static_cast<float>(model[i]);
+  }
+  for (int i = 0; i < n; ++i) {
+    mask[set.index[i]] = Model::IsInlier(set, s, i);
+  }
+  for (int i = 0; i < n; ++i) {
+    if (mask[i]) {
+      best_inliers.push_back(i);
+    }
+  }
+
+  double refined[9];
+  copy(model, model + 9, refined);
+  if (Model::Refine(src, dst, best_inliers, refined)) {
+    for (int i = 0; i < 9; ++i) {
+      s.m[i] = static_cast<float>(refined[i]);
+    }
+    vector<uchar> refined_mask(n);
+    int count = 0;
+    for (int i = 0; i < n; ++i) {
+      refined_mask[set.index[i]] = Model::IsInlier(set, s, i);
+      count += refined_mask[set.index[i]];
+    }
+    if (count >= best) {
+      best = count;
+      copy(refined, refined + 9, model);
+      mask.swap(refined_mask);
+    }
+  }
+
+  if (inliers != NULL) {
+    inliers->swap(mask);
+  }
+  return best;
+}